@@ -7,6 +7,7 @@
 using json = nlohmann::json;
 
 #include <set>
+#include <map>
 #include <vector>
 #include <algorithm>
 #include <cmath>
@@ -25,6 +26,10 @@ using json = nlohmann::json;
 #include <mutex>
 #include <type_traits>
 #include <cstdlib>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <functional>
 
 const char *CERT_BYTES = R"(-----BEGIN CERTIFICATE-----
 MIIFnjCCA4agAwIBAgIQIyrcRJGv6EQmZ1Iq+we5yDANBgkqhkiG9w0BAQwFADBp
@@ -64,16 +69,39 @@ const size_t CERT_BYTES_SIZE = strlen(CERT_BYTES);
 
 #ifdef _WIN32
 #include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#include <windows.h>
 
 std::string HOME_DIR = "USERPROFILE";
 std::string PATH_SEPARATOR = "\\";
 #define MKDIR(dir) _mkdir(dir)
+#define GETPID() _getpid()
+#define UTIME(path) _utime(path, nullptr)
 #else
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <utime.h>
 
 std::string HOME_DIR = "HOME";
 std::string PATH_SEPARATOR = "/";
 #define MKDIR(dir) mkdir(dir, 0755)
+#define GETPID() getpid()
+#define UTIME(path) utime(path, nullptr)
+#endif
+
+// SSE2 is part of every x86-64 target, other targets use the scalar loops
+#if defined(__SSE2__) || defined(_M_X64) ||                                     \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BDMS_SSE2 1
 #endif
 
 enum class BDMSDataType {
@@ -179,6 +207,15 @@ typedef std::string BDMSDataID;
 
 enum HTTPMethod { GET, HEAD, POST };
 
+/* Receives the body of a successful (HTTP 200) GET request block by block
+instead of buffering it in the response. begin() is called before the first
+block of every attempt, so a retried request starts over from a clean state.
+Returning false from receive() aborts the request without retrying it. */
+struct ResponseStream {
+    std::function<void()> begin;
+    httplib::ContentReceiver receive;
+};
+
 struct BDMSProvidedConfig {
     std::string profile, host, apiKey, protocol, certificatePath, userAgent;
 };
@@ -189,46 +226,2258 @@ struct BDMSResolvedConfig {
     std::string baseUrl, apiKey, certificatePath, userAgent;
 };
 
-// see
-// https://raymii.org/s/tutorials/Cpp_std_async_with_a_concurrency_limit.html
-class Semafoor {
+/* Persistent worker pool used for all data fetches of a BaseBDMSDataManager.
+
+Each worker owns a deque of tasks. Tasks submitted from outside the pool are
+distributed round-robin over the deques, a worker takes tasks from the front of
+its own deque and steals from the back of the others when it runs dry. The
+number of queued (not yet started) tasks is bounded: submitting from outside
+the pool blocks until there is room, which keeps a huge batch from allocating
+all of its tasks up front. Tasks submitted from a worker thread are pushed to
+that worker's own deque without blocking, so a task can never deadlock waiting
+for room in its own pool.
+
+Low priority tasks (submitLowPriority) wait in a separate unbounded queue. A
+worker only starts one when no regular task is queued, and at most a quarter of
+the workers run low priority tasks at any time, so background work never delays
+a regular task by more than the low priority tasks already running.
+
+isLowPriorityTask() tells code running in a worker whether it runs for a low
+priority task, so its requests can give way to those of regular tasks.
+
+parallelFor splits CPU-bound work over the calling thread and idle workers. The
+caller works on the chunks itself, so it completes even when every worker is
+busy, and never blocks on a full queue. */
+class FetchPool {
   public:
-    explicit Semafoor(size_t count) : count(count) {}
-    size_t getCount() const { return count; };
-    void lock() { // call before critical section
-        std::unique_lock<std::mutex> lock(mutex);
-        condition_variable.wait(lock, [this] {
-            if (count != 0) // written out for clarity, could just be return
-                            // (count != 0);
-                return true;
-            else
-                return false;
+    FetchPool(size_t threadCount, size_t maxQueuedTasks);
+    ~FetchPool();
+    FetchPool(const FetchPool &) = delete;
+    FetchPool &operator=(const FetchPool &) = delete;
+
+    template <typename F>
+    auto submit(F task) -> std::future<decltype(task())>;
+    template <typename F>
+    auto submitLowPriority(F task) -> std::future<decltype(task())>;
+    template <typename F> void parallelFor(size_t count, size_t grain, F body);
+    size_t getThreadCount() const { return _threads.size(); }
+    static size_t defaultThreadCount();
+    static bool isLowPriorityTask() { return _runningLowPriority; }
+
+  private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool enqueue(std::function<void()> task, bool wait = true);
+    void enqueueLowPriority(std::function<void()> task);
+    bool popTask(size_t index, std::function<void()> &task);
+    bool lowPriorityReady() const;
+    void workerLoop(size_t index);
+
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _workAvailable;
+    std::condition_variable _spaceAvailable;
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _nextQueue;
+    size_t _maxQueued;
+    bool _stopping;
+    // guarded by _mutex
+    std::deque<std::function<void()>> _lowPriority;
+    size_t _lowPriorityRunning;
+    size_t _maxLowPriorityRunning;
+
+    // the pool (and deque index) the current thread works for, if any
+    static thread_local FetchPool *_currentPool;
+    static thread_local size_t _currentIndex;
+    static thread_local bool _runningLowPriority;
+};
+
+thread_local FetchPool *FetchPool::_currentPool = nullptr;
+thread_local size_t FetchPool::_currentIndex = 0;
+thread_local bool FetchPool::_runningLowPriority = false;
+
+FetchPool::FetchPool(size_t threadCount, size_t maxQueuedTasks)
+    : _queued(0), _nextQueue(0), _maxQueued(std::max<size_t>(maxQueuedTasks, 1)),
+      _stopping(false), _lowPriorityRunning(0) {
+    threadCount = std::max<size_t>(threadCount, 1);
+    _maxLowPriorityRunning = std::max<size_t>(threadCount / 4, 1);
+    for (size_t i = 0; i < threadCount; ++i) {
+        _queues.push_back(httplib::detail::make_unique<WorkQueue>());
+    }
+    for (size_t i = 0; i < threadCount; ++i) {
+        _threads.emplace_back(&FetchPool::workerLoop, this, i);
+    }
+}
+
+/* Queued tasks are still run before the workers exit, so every future handed
+out by submit() is eventually satisfied. */
+FetchPool::~FetchPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _workAvailable.notify_all();
+    _spaceAvailable.notify_all();
+    for (auto &thread : _threads) {
+        thread.join();
+    }
+}
+
+// Fetch tasks spend most of their time waiting on the network, so use more
+// workers than cores. hardware_concurrency() may return 0 if unknown.
+size_t FetchPool::defaultThreadCount() {
+    return std::max<unsigned int>(std::thread::hardware_concurrency(), 2) * 2;
+}
+
+template <typename F>
+auto FetchPool::submit(F task) -> std::future<decltype(task())> {
+    // std::function requires a copyable target, packaged_task is move-only
+    auto packaged =
+        std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+    std::future<decltype(task())> future = packaged->get_future();
+    enqueue([packaged] { (*packaged)(); });
+    return future;
+}
+
+template <typename F>
+auto FetchPool::submitLowPriority(F task) -> std::future<decltype(task())> {
+    auto packaged =
+        std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+    std::future<decltype(task())> future = packaged->get_future();
+    enqueueLowPriority([packaged] { (*packaged)(); });
+    return future;
+}
+
+// Without wait, returns false instead of blocking while the queue is full
+bool FetchPool::enqueue(std::function<void()> task, bool wait) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    size_t index = _currentIndex;
+    if (_currentPool != this) {
+        if (!wait && (_queued >= _maxQueued || _stopping)) {
+            return false;
+        }
+        _spaceAvailable.wait(
+            lock, [this] { return _queued < _maxQueued || _stopping; });
+        if (_stopping) {
+            throw std::runtime_error("FetchPool is shutting down");
+        }
+        index = _nextQueue++ % _queues.size();
+    }
+
+    // count the task before it becomes visible, so a worker that pops it
+    // right away never sees the counter drop below the real queue length
+    ++_queued;
+    {
+        WorkQueue &queue = *_queues[index];
+        std::lock_guard<std::mutex> queueLock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    _workAvailable.notify_one();
+    return true;
+}
+
+/* Run body(begin, end) on the chunks [0, grain), [grain, 2 grain), ... of
+[0, count) and return once all are done. Chunks are claimed from a shared
+counter, by the calling thread and by helper tasks, so helpers that start late
+only find less left to do. The first exception of body is rethrown. */
+template <typename F>
+void FetchPool::parallelFor(size_t count, size_t grain, F body) {
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = count / grain + (count % grain != 0);
+    if (chunks <= 1) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+
+    struct Shared {
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable idle;
+        size_t active = 0;
+        std::exception_ptr error;
+    };
+    auto shared = std::make_shared<Shared>();
+    std::function<void(size_t, size_t)> run = body;
+    std::function<void()> work = [shared, &run, count, grain, chunks]() {
+        for (size_t chunk; (chunk = shared->next++) < chunks;) {
+            try {
+                run(chunk * grain, std::min(count, (chunk + 1) * grain));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (!shared->error) {
+                    shared->error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    // helpers only touch run while registered as active
+    size_t cores = std::max<unsigned int>(std::thread::hardware_concurrency(), 1);
+    size_t helpers = std::min(std::min(chunks, cores) - 1, _threads.size());
+    for (size_t i = 0; i < helpers; ++i) {
+        bool queued = enqueue(
+            [shared, work, chunks]() {
+                {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    if (shared->next >= chunks) {
+                        return;
+                    }
+                    ++shared->active;
+                }
+                work();
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (--shared->active == 0) {
+                    shared->idle.notify_all();
+                }
+            },
+            false);
+        if (!queued) {
+            break;
+        }
+    }
+
+    work();
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->idle.wait(lock, [&shared] { return shared->active == 0; });
+    if (shared->error) {
+        std::rethrow_exception(shared->error);
+    }
+}
+
+void FetchPool::enqueueLowPriority(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopping) {
+            throw std::runtime_error("FetchPool is shutting down");
+        }
+        _lowPriority.push_back(std::move(task));
+    }
+    _workAvailable.notify_one();
+}
+
+// Called with _mutex held. While stopping, the remaining low priority tasks
+// are drained without the limit.
+bool FetchPool::lowPriorityReady() const {
+    return _queued == 0 && !_lowPriority.empty() &&
+           (_lowPriorityRunning < _maxLowPriorityRunning || _stopping);
+}
+
+bool FetchPool::popTask(size_t index, std::function<void()> &task) {
+    // own deque first (oldest task), then steal the newest task of another
+    for (size_t i = 0; i < _queues.size(); ++i) {
+        WorkQueue &queue = *_queues[(index + i) % _queues.size()];
+        std::lock_guard<std::mutex> queueLock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        --_queued;
+        return true;
+    }
+    return false;
+}
+
+void FetchPool::workerLoop(size_t index) {
+    _currentPool = this;
+    _currentIndex = index;
+
+    for (;;) {
+        std::function<void()> task;
+        if (popTask(index, task)) {
+            {
+                // synchronize with submitters waiting for room
+                std::lock_guard<std::mutex> lock(_mutex);
+            }
+            _spaceAvailable.notify_one();
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (lowPriorityReady()) {
+            task = std::move(_lowPriority.front());
+            _lowPriority.pop_front();
+            ++_lowPriorityRunning;
+            lock.unlock();
+            _runningLowPriority = true;
+            task();
+            _runningLowPriority = false;
+            lock.lock();
+            --_lowPriorityRunning;
+            // another low priority task may start now
+            _workAvailable.notify_one();
+            continue;
+        }
+        _workAvailable.wait(lock, [this] {
+            return _queued > 0 || lowPriorityReady() ||
+                   (_stopping && _lowPriority.empty());
+        });
+        if (_stopping && _queued == 0 && _lowPriority.empty()) {
+            return;
+        }
+    }
+}
+
+/* Inflates a gzip (or zlib) stream straight into a caller-provided buffer of
+known size, so every decompressed byte is written exactly once, at its final
+position. Input that would produce more bytes than the buffer holds fails the
+stream instead of overrunning the buffer. Feed the compressed data block by
+block with inflate(), then check finished(). */
+class BoundedInflater {
+  public:
+    BoundedInflater(char *buffer, size_t size);
+    ~BoundedInflater();
+    BoundedInflater(const BoundedInflater &) = delete;
+    BoundedInflater &operator=(const BoundedInflater &) = delete;
+
+    void reset();
+    bool inflate(const char *data, size_t length);
+    // end of stream reached with the buffer filled exactly
+    bool finished() const { return _ended && _written == _size; }
+    size_t getWrittenSize() const { return _written; }
+    const std::string &getError() const { return _error; }
+
+  private:
+    bool fail(const std::string &error);
+
+    z_stream _stream;
+    char *_buffer;
+    size_t _size;
+    size_t _written;
+    bool _ended;
+    std::string _error;
+    // zlib rejects a null next_out even when avail_out is 0
+    char _emptyOutput;
+};
+
+BoundedInflater::BoundedInflater(char *buffer, size_t size)
+    : _buffer(buffer), _size(size), _written(0), _ended(false) {
+    std::memset(&_stream, 0, sizeof(_stream));
+    // 15 window bits + 32: detect gzip or zlib header automatically
+    if (inflateInit2(&_stream, 15 + 32) != Z_OK) {
+        throw std::runtime_error("Failed to initialize zlib inflate stream");
+    }
+}
+
+BoundedInflater::~BoundedInflater() { inflateEnd(&_stream); }
+
+void BoundedInflater::reset() {
+    inflateReset(&_stream);
+    _written = 0;
+    _ended = false;
+    _error.clear();
+}
+
+bool BoundedInflater::fail(const std::string &error) {
+    if (_error.empty()) {
+        _error = error;
+    }
+    return false;
+}
+
+bool BoundedInflater::inflate(const char *data, size_t length) {
+    if (!_error.empty()) {
+        return false;
+    }
+
+    while (length > 0) {
+        if (_ended) {
+            return fail("unexpected data after the end of the stream");
+        }
+
+        // avail_in and avail_out are 32 bit, feed larger blocks in pieces
+        uInt inputChunk = static_cast<uInt>(
+            std::min<size_t>(length, std::numeric_limits<uInt>::max()));
+        _stream.next_in =
+            reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        _stream.avail_in = inputChunk;
+
+        while (_stream.avail_in > 0 && !_ended) {
+            size_t remaining = _size - _written;
+            uInt outputChunk = static_cast<uInt>(
+                std::min<size_t>(remaining, std::numeric_limits<uInt>::max()));
+            _stream.next_out = reinterpret_cast<Bytef *>(
+                remaining > 0 ? _buffer + _written : &_emptyOutput);
+            _stream.avail_out = outputChunk;
+
+            int ret = ::inflate(&_stream, Z_NO_FLUSH);
+            _written += outputChunk - _stream.avail_out;
+
+            if (ret == Z_STREAM_END) {
+                _ended = true;
+            } else if (ret == Z_BUF_ERROR && remaining == 0) {
+                // no progress possible without more room in the buffer
+                return fail("decompressed data exceeds the expected " +
+                            std::to_string(_size) + " bytes");
+            } else if (ret != Z_OK) {
+                std::string reason = _stream.msg ? std::string(_stream.msg)
+                                                 : "zlib error " +
+                                                       std::to_string(ret);
+                return fail("corrupt compressed data (" + reason + ")");
+            }
+        }
+
+        size_t consumed = inputChunk - _stream.avail_in;
+        if (_ended && _stream.avail_in > 0) {
+            return fail("unexpected data after the end of the stream");
+        }
+        data += consumed;
+        length -= consumed;
+    }
+    return true;
+}
+
+/* Generates the values of special:range and special:constant identifiers.
+Every value is computed from its index, never from the previous value, so any
+slice can be generated on its own and the loops run in SIMD lanes.
+
+Integer sequences wrap like repeated addition of the step in the value type.
+Float and double sequences are computed in double as origin + index * delta,
+like linspace, so rounding errors do not add up over long sequences.
+
+Constants can be written with non-temporal (streaming) stores, which bypass
+the CPU caches. That is faster for arrays much larger than the caches, and
+keeps the fill from evicting the data of other threads. */
+class SequenceGenerator {
+  public:
+    // Generated slices of this many bytes are spread over threads
+    static const size_t GRAIN_BYTES = 1 << 20;
+
+    // buffer[i] = origin + (first + i) * step for i < size
+    template <typename T>
+    static void integers(T *buffer, size_t size, T origin, T step,
+                         size_t first);
+    // buffer[i] = origin + (first + i) * delta for i < size
+    template <typename T>
+    static void linspace(T *buffer, size_t size, double origin, double delta,
+                         size_t first);
+    // buffer[i] = value for i < size
+    template <typename T>
+    static void constant(T *buffer, size_t size, T value, bool streaming);
+
+  private:
+#ifdef BDMS_SSE2
+    static __m128i addLanes(__m128i a, __m128i b, size_t typeSize);
+    static void storeLanes(double *buffer, __m128d low, __m128d high);
+    static void storeLanes(float *buffer, __m128d low, __m128d high);
+#endif
+};
+
+template <typename T>
+void SequenceGenerator::integers(T *buffer, size_t size, T origin, T step,
+                                 size_t first) {
+    // unsigned arithmetic of at least 32 bits, which wraps instead of
+    // overflowing
+    typedef typename std::make_unsigned<T>::type U;
+    typedef typename std::conditional<(sizeof(T) < 4), uint32_t, U>::type W;
+    W base = static_cast<U>(origin);
+    W stride = static_cast<U>(step);
+
+    size_t i = 0;
+#ifdef BDMS_SSE2
+    const size_t lanes = 16 / sizeof(T);
+    if (size >= 2 * lanes) {
+        U values[16 / sizeof(T)];
+        U increments[16 / sizeof(T)];
+        for (size_t k = 0; k < lanes; ++k) {
+            values[k] = static_cast<U>(base + static_cast<W>(first + k) * stride);
+            increments[k] = static_cast<U>(static_cast<W>(lanes) * stride);
+        }
+        __m128i value = _mm_loadu_si128(reinterpret_cast<__m128i *>(values));
+        __m128i increment =
+            _mm_loadu_si128(reinterpret_cast<__m128i *>(increments));
+        for (; i + lanes <= size; i += lanes) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + i), value);
+            value = addLanes(value, increment, sizeof(T));
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        buffer[i] = static_cast<T>(
+            static_cast<U>(base + static_cast<W>(first + i) * stride));
+    }
+}
+
+template <typename T>
+void SequenceGenerator::linspace(T *buffer, size_t size, double origin,
+                                 double delta, size_t first) {
+    size_t i = 0;
+#ifdef BDMS_SSE2
+    // indices are exact in double up to 2^53
+    __m128d index = _mm_set_pd(static_cast<double>(first + 1),
+                               static_cast<double>(first));
+    const __m128d two = _mm_set1_pd(2.0);
+    const __m128d origins = _mm_set1_pd(origin);
+    const __m128d deltas = _mm_set1_pd(delta);
+    for (; i + 4 <= size; i += 4) {
+        __m128d low = _mm_add_pd(origins, _mm_mul_pd(index, deltas));
+        index = _mm_add_pd(index, two);
+        __m128d high = _mm_add_pd(origins, _mm_mul_pd(index, deltas));
+        index = _mm_add_pd(index, two);
+        storeLanes(buffer + i, low, high);
+    }
+#endif
+    for (; i < size; ++i) {
+        buffer[i] =
+            static_cast<T>(origin + static_cast<double>(first + i) * delta);
+    }
+}
+
+template <typename T>
+void SequenceGenerator::constant(T *buffer, size_t size, T value,
+                                 bool streaming) {
+    size_t i = 0;
+#ifdef BDMS_SSE2
+    // stores to 16-byte aligned addresses, after the values up to the first
+    // one, which needs the buffer aligned to the size of its values
+    const size_t lanes = 16 / sizeof(T);
+    uintptr_t address = reinterpret_cast<uintptr_t>(buffer);
+    if (size >= 2 * lanes && address % sizeof(T) == 0) {
+        for (; (address + i * sizeof(T)) % 16 != 0; ++i) {
+            buffer[i] = value;
+        }
+        T values[16 / sizeof(T)];
+        std::fill_n(values, lanes, value);
+        __m128i pattern = _mm_loadu_si128(reinterpret_cast<__m128i *>(values));
+        if (streaming) {
+            for (; i + lanes <= size; i += lanes) {
+                _mm_stream_si128(reinterpret_cast<__m128i *>(buffer + i),
+                                 pattern);
+            }
+            // streaming stores are weakly ordered, publish them before the
+            // caller signals completion
+            _mm_sfence();
+        } else {
+            for (; i + lanes <= size; i += lanes) {
+                _mm_store_si128(reinterpret_cast<__m128i *>(buffer + i),
+                                pattern);
+            }
+        }
+    }
+#else
+    (void)streaming;
+#endif
+    std::fill_n(buffer + i, size - i, value);
+}
+
+#ifdef BDMS_SSE2
+// typeSize is a constant at every call, so the switch folds away
+__m128i SequenceGenerator::addLanes(__m128i a, __m128i b, size_t typeSize) {
+    switch (typeSize) {
+    case 1:
+        return _mm_add_epi8(a, b);
+    case 2:
+        return _mm_add_epi16(a, b);
+    case 4:
+        return _mm_add_epi32(a, b);
+    default:
+        return _mm_add_epi64(a, b);
+    }
+}
+
+void SequenceGenerator::storeLanes(double *buffer, __m128d low,
+                                   __m128d high) {
+    _mm_storeu_pd(buffer, low);
+    _mm_storeu_pd(buffer + 2, high);
+}
+
+void SequenceGenerator::storeLanes(float *buffer, __m128d low, __m128d high) {
+    _mm_storeu_ps(buffer,
+                  _mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high)));
+}
+#endif
+
+/* Keep-alive connections to one BDMS host, shared by all fetch workers of a
+BaseBDMSDataManager. A worker checks a client out with acquire() for the
+duration of one request and the returned Lease hands it back when it goes out
+of scope. At most maxConnections clients exist at a time, acquire() blocks
+while all of them are in use. Background requests (e.g. prefetches) lease at
+most half of the connections, and only while no other request waits for one.
+Clients left idle for longer than the idle timeout are closed the next time
+the pool is used. */
+class ConnectionPool {
+  public:
+    class Lease {
+      public:
+        Lease(ConnectionPool &pool, std::unique_ptr<httplib::Client> client,
+              bool background)
+            : _pool(&pool), _client(std::move(client)), _reusable(true),
+              _background(background) {}
+        Lease(Lease &&other)
+            : _pool(other._pool), _client(std::move(other._client)),
+              _reusable(other._reusable), _background(other._background) {}
+        ~Lease() {
+            if (_client) {
+                _pool->release(std::move(_client), _reusable, _background);
+            }
+        }
+        httplib::Client *operator->() { return _client.get(); }
+        // close the connection instead of returning it, e.g. after an error
+        void discard() { _reusable = false; }
+
+      private:
+        ConnectionPool *_pool;
+        std::unique_ptr<httplib::Client> _client;
+        bool _reusable;
+        bool _background;
+    };
+
+    ConnectionPool(const std::string &baseUrl,
+                   std::function<void(httplib::Client &)> configure,
+                   size_t maxConnections, std::chrono::seconds idleTimeout)
+        : _baseUrl(baseUrl), _configure(std::move(configure)),
+          _maxConnections(std::max<size_t>(maxConnections, 1)),
+          _idleTimeout(idleTimeout), _open(0), _foregroundWaiting(0),
+          _backgroundLeased(0) {}
+
+    Lease acquire(bool background = false);
+    void setMaxConnections(size_t maxConnections);
+    void setIdleTimeout(std::chrono::seconds idleTimeout);
+    size_t getOpenCount();
+
+  private:
+    struct IdleClient {
+        std::unique_ptr<httplib::Client> client;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    void release(std::unique_ptr<httplib::Client> client, bool reusable,
+                 bool background);
+    bool hasRoom() const;
+    std::vector<std::unique_ptr<httplib::Client>> takeExpired();
+
+    std::string _baseUrl;
+    std::function<void(httplib::Client &)> _configure;
+    size_t _maxConnections;
+    std::chrono::seconds _idleTimeout;
+    size_t _open; // idle and checked out clients
+    size_t _foregroundWaiting;
+    size_t _backgroundLeased;
+    std::deque<IdleClient> _idle; // least recently used first
+    std::mutex _mutex;
+    std::condition_variable _available;
+};
+
+ConnectionPool::Lease ConnectionPool::acquire(bool background) {
+    std::vector<std::unique_ptr<httplib::Client>> expired;
+    std::unique_lock<std::mutex> lock(_mutex);
+    expired = takeExpired();
+    if (background) {
+        _available.wait(lock, [this] {
+            return _foregroundWaiting == 0 &&
+                   _backgroundLeased < std::max<size_t>(_maxConnections / 2, 1) &&
+                   hasRoom();
+        });
+        ++_backgroundLeased;
+    } else {
+        ++_foregroundWaiting;
+        _available.wait(lock, [this] { return hasRoom(); });
+        // background requests may go ahead again
+        if (--_foregroundWaiting == 0) {
+            _available.notify_all();
+        }
+    }
+
+    if (!_idle.empty()) {
+        // most recently used client, its connection is the most likely to
+        // still be alive
+        std::unique_ptr<httplib::Client> client =
+            std::move(_idle.back().client);
+        _idle.pop_back();
+        return Lease(*this, std::move(client), background);
+    }
+
+    ++_open;
+    lock.unlock();
+    try {
+        auto client = httplib::detail::make_unique<httplib::Client>(_baseUrl);
+        _configure(*client);
+        return Lease(*this, std::move(client), background);
+    } catch (...) {
+        lock.lock();
+        --_open;
+        if (background) {
+            --_backgroundLeased;
+        }
+        _available.notify_all();
+        throw;
+    }
+}
+
+// Called with _mutex held
+bool ConnectionPool::hasRoom() const {
+    return !_idle.empty() || _open < _maxConnections;
+}
+
+void ConnectionPool::release(std::unique_ptr<httplib::Client> client,
+                             bool reusable, bool background) {
+    std::vector<std::unique_ptr<httplib::Client>> expired;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (background) {
+            --_backgroundLeased;
+        }
+        if (reusable && _open <= _maxConnections) {
+            _idle.push_back(
+                IdleClient{std::move(client), std::chrono::steady_clock::now()});
+        } else {
+            --_open;
+        }
+        expired = takeExpired();
+    }
+    // waiters of both kinds share the condition
+    _available.notify_all();
+    // clients (and their sockets) are closed here, outside of the lock
+}
+
+void ConnectionPool::setMaxConnections(size_t maxConnections) {
+    std::vector<std::unique_ptr<httplib::Client>> expired;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxConnections = std::max<size_t>(maxConnections, 1);
+        expired = takeExpired();
+    }
+    _available.notify_all();
+}
+
+void ConnectionPool::setIdleTimeout(std::chrono::seconds idleTimeout) {
+    std::vector<std::unique_ptr<httplib::Client>> expired;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _idleTimeout = idleTimeout;
+        expired = takeExpired();
+    }
+}
+
+size_t ConnectionPool::getOpenCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _open;
+}
+
+// Remove idle clients past the idle timeout, or beyond the connection limit
+// after it was lowered. The caller holds the mutex.
+std::vector<std::unique_ptr<httplib::Client>> ConnectionPool::takeExpired() {
+    std::vector<std::unique_ptr<httplib::Client>> expired;
+    auto now = std::chrono::steady_clock::now();
+    while (!_idle.empty() && (now - _idle.front().since > _idleTimeout ||
+                              _open > _maxConnections)) {
+        expired.push_back(std::move(_idle.front().client));
+        _idle.pop_front();
+        --_open;
+    }
+    return expired;
+}
+
+/* Concurrency limit for HTTP requests that adapts to how the server copes
+(additive increase, multiplicative decrease). While requests succeed with a
+steady latency the limit grows by about one per round trip. It is halved when
+the server signals overload (HTTP 429/503, timeouts) and reduced by 10% when
+latency rises to over twice the lowest latency seen, but at most once per round
+trip so a burst of failures counts as a single congestion signal. acquire()
+blocks while the number of requests in flight has reached the limit.
+Background requests (e.g. prefetches) hold at most half of the limit, and only
+start while no other request waits for a permit. */
+class AdaptiveConcurrencyLimiter {
+  public:
+    enum class Outcome { Success, Overload, Ignore };
+
+    AdaptiveConcurrencyLimiter(size_t initialLimit, size_t minLimit,
+                               size_t maxLimit)
+        : _minLimit(std::max<size_t>(minLimit, 1)),
+          _maxLimit(std::max(maxLimit, _minLimit)),
+          _limit(static_cast<double>(
+              std::min(std::max(initialLimit, _minLimit), _maxLimit))),
+          _inFlight(0), _foregroundWaiting(0), _backgroundInFlight(0),
+          _baselineLatency(0), _smoothedLatency(0) {}
+
+    void acquire(bool background = false);
+    void release(Outcome outcome, double latencySeconds,
+                 bool background = false);
+    size_t getLimit();
+    size_t getInFlight();
+    void setMaxLimit(size_t maxLimit);
+
+  private:
+    void decrease(double factor);
+
+    size_t _minLimit;
+    size_t _maxLimit;
+    double _limit;
+    size_t _inFlight;
+    size_t _foregroundWaiting;
+    size_t _backgroundInFlight;
+    double _baselineLatency; // seconds, 0 until the first success
+    double _smoothedLatency;
+    std::chrono::steady_clock::time_point _lastDecrease;
+    std::mutex _mutex;
+    std::condition_variable _available;
+};
+
+void AdaptiveConcurrencyLimiter::acquire(bool background) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (background) {
+        _available.wait(lock, [this] {
+            size_t limit = static_cast<size_t>(_limit);
+            return _foregroundWaiting == 0 && _inFlight < limit &&
+                   _backgroundInFlight < std::max<size_t>(limit / 2, 1);
         });
-        --count;
+        ++_backgroundInFlight;
+    } else {
+        ++_foregroundWaiting;
+        _available.wait(lock, [this] {
+            return _inFlight < static_cast<size_t>(_limit);
+        });
+        // background requests may go ahead again
+        if (--_foregroundWaiting == 0) {
+            _available.notify_all();
+        }
+    }
+    ++_inFlight;
+}
+
+/* latencySeconds is the time until the response headers arrived, so it does
+not grow with the size of the payload. */
+void AdaptiveConcurrencyLimiter::release(Outcome outcome,
+                                         double latencySeconds,
+                                         bool background) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        --_inFlight;
+        if (background) {
+            --_backgroundInFlight;
+        }
+
+        if (outcome == Outcome::Overload) {
+            decrease(0.5);
+        } else if (outcome == Outcome::Success) {
+            if (_baselineLatency == 0) {
+                _baselineLatency = latencySeconds;
+                _smoothedLatency = latencySeconds;
+            }
+            _smoothedLatency = 0.8 * _smoothedLatency + 0.2 * latencySeconds;
+            // follow the lowest latency down at once, up only slowly so the
+            // baseline can recover from e.g. a route change
+            _baselineLatency =
+                std::min(latencySeconds,
+                         _baselineLatency +
+                             0.01 * (latencySeconds - _baselineLatency));
+
+            // the absolute margin keeps jitter on very fast links from
+            // counting as congestion
+            if (_smoothedLatency > 2 * _baselineLatency &&
+                _smoothedLatency > _baselineLatency + 0.05) {
+                decrease(0.9);
+            } else {
+                _limit = std::min(_limit + 1.0 / _limit,
+                                  static_cast<double>(_maxLimit));
+            }
+        }
+    }
+    _available.notify_all();
+}
+
+// The caller holds the mutex
+void AdaptiveConcurrencyLimiter::decrease(double factor) {
+    auto now = std::chrono::steady_clock::now();
+    auto roundTrip = std::chrono::duration<double>(
+        std::max(_smoothedLatency, 0.1));
+    if (now - _lastDecrease < roundTrip) {
+        return;
+    }
+    _lastDecrease = now;
+    _limit = std::max(_limit * factor, static_cast<double>(_minLimit));
+}
+
+size_t AdaptiveConcurrencyLimiter::getLimit() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return static_cast<size_t>(_limit);
+}
+
+size_t AdaptiveConcurrencyLimiter::getInFlight() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _inFlight;
+}
+
+void AdaptiveConcurrencyLimiter::setMaxLimit(size_t maxLimit) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxLimit = std::max(maxLimit, _minLimit);
+        _limit = std::min(_limit, static_cast<double>(_maxLimit));
+    }
+    _available.notify_all();
+}
+
+// RAII wrapper around AdaptiveConcurrencyLimiter: acquires a permit when
+// constructed and releases it when destroyed. Set outcome and latency before
+// it goes out of scope.
+class ConcurrencyPermit {
+  public:
+    explicit ConcurrencyPermit(AdaptiveConcurrencyLimiter &limiter,
+                               bool background = false)
+        : outcome(AdaptiveConcurrencyLimiter::Outcome::Ignore),
+          latencySeconds(0), _limiter(limiter), _background(background) {
+        _limiter.acquire(_background);
+    }
+    ~ConcurrencyPermit() {
+        _limiter.release(outcome, latencySeconds, _background);
+    }
+
+    AdaptiveConcurrencyLimiter::Outcome outcome;
+    double latencySeconds;
+
+  private:
+    AdaptiveConcurrencyLimiter &_limiter;
+    bool _background;
+};
+
+/* Circuit breaker for the BDMS host of a manager. While closed, it keeps the
+outcomes of the last 50 requests; once at least minRequests are recorded and
+failurePercent of them failed (transport errors, HTTP 5xx), it opens. While
+open, requests fail at once instead of each retrying with backoff for minutes.
+After openSeconds it is half-open and lets a single probe request through,
+which closes the breaker if it succeeds and opens it again if it fails. A
+failurePercent of 0 disables the breaker. */
+class CircuitBreaker {
+  private:
+    enum class Admission { Rejected, Normal, Probe };
+
+  public:
+    enum class State { Closed, Open, HalfOpen };
+    enum class Outcome { Success, Failure, Ignore };
+
+    // One request attempt. Call finish() with the outcome once the response
+    // is in; an attempt that ends without it is not counted.
+    class Attempt {
+      public:
+        explicit Attempt(CircuitBreaker &breaker)
+            : _breaker(breaker), _admission(breaker.admit()) {}
+        ~Attempt() { finish(Outcome::Ignore); }
+        Attempt(const Attempt &) = delete;
+        Attempt &operator=(const Attempt &) = delete;
+
+        bool isAllowed() const { return _admission != Admission::Rejected; }
+        void finish(Outcome outcome);
+
+      private:
+        CircuitBreaker &_breaker;
+        Admission _admission;
+    };
+
+    CircuitBreaker(size_t minRequests, size_t failurePercent,
+                   double openSeconds)
+        : _minRequests(std::max<size_t>(minRequests, 1)),
+          _failurePercent(failurePercent), _openDuration(openSeconds),
+          _state(State::Closed), _recentFailures(0), _probing(false),
+          _rejected(0) {}
+
+    State getState();
+    size_t getRejectedCount() const { return _rejected; }
+    double getSecondsUntilProbe();
+
+  private:
+    Admission admit();
+    void record(Admission admission, Outcome outcome);
+    void open();
+
+    const size_t _minRequests;
+    const size_t _failurePercent;
+    const std::chrono::duration<double> _openDuration;
+    std::mutex _mutex;
+    State _state;
+    std::deque<bool> _recent; // true for a failure, oldest first
+    size_t _recentFailures;
+    bool _probing;
+    std::chrono::steady_clock::time_point _openUntil;
+    std::atomic<size_t> _rejected;
+};
+
+void CircuitBreaker::Attempt::finish(Outcome outcome) {
+    if (_admission != Admission::Rejected) {
+        _breaker.record(_admission, outcome);
+        _admission = Admission::Rejected;
+    }
+}
+
+CircuitBreaker::State CircuitBreaker::getState() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _state;
+}
+
+double CircuitBreaker::getSecondsUntilProbe() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::max(std::chrono::duration<double>(
+                        _openUntil - std::chrono::steady_clock::now())
+                        .count(),
+                    0.0);
+}
+
+CircuitBreaker::Admission CircuitBreaker::admit() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_state == State::Open &&
+        std::chrono::steady_clock::now() >= _openUntil) {
+        _state = State::HalfOpen;
+        _probing = false;
+    }
+    if (_state == State::Closed) {
+        return Admission::Normal;
+    }
+    if (_state == State::HalfOpen && !_probing) {
+        _probing = true;
+        return Admission::Probe;
+    }
+    ++_rejected;
+    return Admission::Rejected;
+}
+
+void CircuitBreaker::record(Admission admission, Outcome outcome) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (admission == Admission::Probe) {
+        if (outcome == Outcome::Failure) {
+            open();
+        } else if (outcome == Outcome::Success) {
+            _state = State::Closed;
+        } else {
+            _probing = false; // let the next request probe
+        }
+        return;
+    }
+
+    // requests admitted before the breaker opened do not count
+    if (_state != State::Closed || outcome == Outcome::Ignore ||
+        _failurePercent == 0) {
+        return;
+    }
+    _recent.push_back(outcome == Outcome::Failure);
+    _recentFailures += outcome == Outcome::Failure;
+    if (_recent.size() > 50) {
+        _recentFailures -= _recent.front();
+        _recent.pop_front();
+    }
+    if (_recent.size() >= _minRequests &&
+        _recentFailures * 100 >= _failurePercent * _recent.size()) {
+        open();
+    }
+}
+
+// Called with _mutex held
+void CircuitBreaker::open() {
+    _state = State::Open;
+    _openUntil = std::chrono::steady_clock::now() +
+                 std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                     _openDuration);
+    _recent.clear();
+    _recentFailures = 0;
+    _probing = false;
+}
+
+/* Failures of requests that would fail the same way again, e.g. HTTP 404 for
+an unknown data ID, kept for a short time so that repeated requests for the
+same endpoint fail at once. A time to live of 0 disables the cache. */
+class NegativeCache {
+  public:
+    explicit NegativeCache(double ttlSeconds)
+        : _ttlSeconds(ttlSeconds), _hits(0) {}
+
+    // HTTP 4xx, except authentication, timeouts and rate limiting
+    static bool isPermanent(int status) {
+        return status >= 400 && status < 500 && status != 401 &&
+               status != 403 && status != 408 && status != 429;
     }
-    void unlock() { // call after critical section
-        std::unique_lock<std::mutex> lock(mutex);
-        ++count;
-        condition_variable.notify_one();
+    bool find(const std::string &endpoint, std::string &title,
+              std::string &message);
+    void insert(const std::string &endpoint, const std::string &title,
+                const std::string &message);
+    void setTtl(double ttlSeconds);
+    size_t getHitCount() const { return _hits; }
+
+  private:
+    struct Entry {
+        std::string title;
+        std::string message;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::mutex _mutex;
+    double _ttlSeconds;
+    std::map<std::string, Entry> _entries;
+    std::atomic<size_t> _hits;
+};
+
+bool NegativeCache::find(const std::string &endpoint, std::string &title,
+                         std::string &message) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _entries.find(endpoint);
+    if (found == _entries.end()) {
+        return false;
+    }
+    if (found->second.expires <= std::chrono::steady_clock::now()) {
+        _entries.erase(found);
+        return false;
+    }
+    title = found->second.title;
+    message = found->second.message;
+    ++_hits;
+    return true;
+}
+
+void NegativeCache::insert(const std::string &endpoint,
+                           const std::string &title,
+                           const std::string &message) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_ttlSeconds <= 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    // bounded: drop expired entries, or all of them if that is not enough
+    if (_entries.size() >= 10000) {
+        for (auto it = _entries.begin(); it != _entries.end();) {
+            it = it->second.expires <= now ? _entries.erase(it) : std::next(it);
+        }
+        if (_entries.size() >= 10000) {
+            _entries.clear();
+        }
+    }
+    _entries[endpoint] =
+        Entry{title, message,
+              now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(_ttlSeconds))};
+}
+
+void NegativeCache::setTtl(double ttlSeconds) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ttlSeconds = ttlSeconds;
+    if (ttlSeconds <= 0) {
+        _entries.clear();
+    }
+}
+
+/* Thrown by fetch tasks that stopped because their CancellationToken was
+cancelled. Not reported through the error handler: the caller asked for it. */
+class FetchCancelledError : public std::runtime_error {
+  public:
+    FetchCancelledError() : std::runtime_error("Fetch cancelled") {}
+};
+
+/* Cooperative cancellation of a batch of fetches. Tasks check the token before
+every request, a running download is aborted from its content receiver and
+retry backoff sleeps wake up early. A token also counts as cancelled once its
+parent is, so destroying a manager stops the batches of all its callers. */
+class CancellationToken {
+  public:
+    explicit CancellationToken(
+        std::shared_ptr<const CancellationToken> parent = nullptr)
+        : _parent(std::move(parent)), _cancelled(false) {}
+    void cancel();
+    bool isCancelled() const;
+    bool sleepFor(std::chrono::duration<double> duration) const;
+    // Throws FetchCancelledError if the token is cancelled
+    void check() const {
+        if (isCancelled()) {
+            throw FetchCancelledError();
+        }
+    }
+
+  private:
+    std::shared_ptr<const CancellationToken> _parent;
+    std::atomic<bool> _cancelled;
+    mutable std::mutex _mutex;
+    mutable std::condition_variable _cancelledChanged;
+};
+
+void CancellationToken::cancel() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cancelled = true;
+    _cancelledChanged.notify_all();
+}
+
+bool CancellationToken::isCancelled() const {
+    return _cancelled || (_parent && _parent->isCancelled());
+}
+
+/* Sleep for the duration, or less if the token gets cancelled. Returns false
+if it was cancelled. A cancelled parent is noticed within 100 ms. */
+bool CancellationToken::sleepFor(std::chrono::duration<double> duration) const {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(duration);
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!isCancelled()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return true;
+        }
+        auto slice = std::min<std::chrono::steady_clock::duration>(
+            deadline - now, std::chrono::milliseconds(100));
+        _cancelledChanged.wait_for(lock, slice);
+    }
+    return false;
+}
+
+/* Table of the downloads in progress, so that concurrent requests for the
+same data attach to one download instead of starting their own. A download is
+registered under one or more keys (e.g. session and data ID, and the hash of
+the compressed payload). The first caller for a key leads: it downloads into
+its own buffer and publishes it with finish(). Later callers follow: wait()
+copies the leader's result into their buffer, or rethrows the leader's error.
+If the leader's batch was cancelled, wait() returns false and the follower
+has to fetch the data itself. The leader keeps its buffer valid until every
+follower has copied from it. */
+class InFlightFetches {
+  public:
+    struct Flight {
+        explicit Flight(size_t size)
+            : byteSize(size), done(false), data(nullptr), followers(0) {}
+        const size_t byteSize;
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool done;
+        const char *data;
+        std::exception_ptr error;
+        size_t followers;
+    };
+
+    InFlightFetches() : _joined(0) {}
+    std::shared_ptr<Flight> joinOrLead(const std::vector<std::string> &keys,
+                                       size_t byteSize, bool &leader);
+    void finish(const std::shared_ptr<Flight> &flight,
+                const std::vector<std::string> &keys, const char *data,
+                std::exception_ptr error);
+    static bool wait(Flight &flight, char *buffer);
+    size_t getJoinedCount() const { return _joined; }
+
+  private:
+    std::mutex _mutex;
+    std::map<std::string, std::shared_ptr<Flight>> _flights;
+    std::atomic<size_t> _joined;
+};
+
+/* Attach to a flight for any of the keys with the same size, or register a
+new flight (under the keys that are free) that the caller has to lead. */
+std::shared_ptr<InFlightFetches::Flight>
+InFlightFetches::joinOrLead(const std::vector<std::string> &keys,
+                            size_t byteSize, bool &leader) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &key : keys) {
+        auto found = _flights.find(key);
+        if (found != _flights.end() && found->second->byteSize == byteSize) {
+            std::lock_guard<std::mutex> flightLock(found->second->mutex);
+            ++found->second->followers;
+            ++_joined;
+            leader = false;
+            return found->second;
+        }
+    }
+
+    auto flight = std::make_shared<Flight>(byteSize);
+    for (auto &key : keys) {
+        // keeps an existing flight of another size under its key
+        _flights.emplace(key, flight);
+    }
+    leader = true;
+    return flight;
+}
+
+void InFlightFetches::finish(const std::shared_ptr<Flight> &flight,
+                             const std::vector<std::string> &keys,
+                             const char *data, std::exception_ptr error) {
+    {
+        // no new followers from here on
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &key : keys) {
+            auto found = _flights.find(key);
+            if (found != _flights.end() && found->second == flight) {
+                _flights.erase(found);
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> flightLock(flight->mutex);
+    flight->done = true;
+    flight->data = data;
+    flight->error = error;
+    flight->changed.notify_all();
+    flight->changed.wait(flightLock,
+                         [&flight] { return flight->followers == 0; });
+}
+
+bool InFlightFetches::wait(Flight &flight, char *buffer) {
+    std::unique_lock<std::mutex> flightLock(flight.mutex);
+    flight.changed.wait(flightLock, [&flight] { return flight.done; });
+    // copying under the lock is fine: the leader only waits for us to finish
+    if (!flight.error && flight.byteSize > 0) {
+        std::memcpy(buffer, flight.data, flight.byteSize);
+    }
+    --flight.followers;
+    flight.changed.notify_all();
+    if (flight.error) {
+        try {
+            std::rethrow_exception(flight.error);
+        } catch (const FetchCancelledError &) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Content-addressed store of compressed payloads: one gzip file per zip_hash
+in a cache directory, shared by all processes of the user. A blob is written
+under a temporary name and renamed when complete, so a reader never sees a
+partial file. Hits are verified while they are inflated (gzip CRC-32 and
+length, and the expected size); a blob that fails is deleted. Once the
+directory grows beyond the size limit, the least recently used blobs are
+evicted. A hit refreshes the modification time, which serves as the LRU
+order. */
+class DiskCache {
+  public:
+    // Writes one download to a temporary file, publish() makes it a blob
+    class Writer {
+      public:
+        Writer(DiskCache &cache, const std::string &hash);
+        ~Writer();
+        void restart();
+        void write(const char *data, size_t length);
+        void publish();
+
+      private:
+        DiskCache &_cache;
+        const std::string _hash;
+        const std::string _tempPath;
+        std::ofstream _file;
+        uint64_t _size;
+    };
+
+    DiskCache(const std::string &directory, uint64_t maxBytes,
+              const std::string &extension = ".gz");
+    static bool isValidKey(const std::string &hash);
+    std::string pathOf(const std::string &hash) const;
+    bool read(const std::string &hash, BoundedInflater &inflater,
+              std::vector<char> *compressed = nullptr);
+    std::unique_ptr<Writer> startWrite(const std::string &hash);
+    void setMaxBytes(uint64_t maxBytes) { _maxBytes = maxBytes; }
+    bool isEnabled() const { return _maxBytes > 0; }
+    size_t getHitCount() const { return _hits; }
+    size_t getMissCount() const { return _misses; }
+
+  private:
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        time_t modified;
+        bool temporary;
+    };
+
+    std::vector<Entry> listEntries() const;
+    bool ownsFile(const std::string &name, bool &temporary) const;
+    void added(uint64_t size);
+    void evict();
+
+    const std::string _directory;
+    const std::string _extension;
+    std::atomic<uint64_t> _maxBytes;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+    std::atomic<size_t> _nextTempId;
+    std::mutex _sizeMutex;
+    // size of the directory as of the last scan, plus what we added since;
+    // unknown (max) until the first scan
+    uint64_t _knownSize;
+};
+
+DiskCache::DiskCache(const std::string &directory, uint64_t maxBytes,
+                     const std::string &extension)
+    : _directory(directory), _extension(extension), _maxBytes(maxBytes),
+      _hits(0), _misses(0),
+      _nextTempId(0), _knownSize(std::numeric_limits<uint64_t>::max()) {
+    MKDIR(_directory.c_str());
+}
+
+// Hashes become file names, so only accept plain hex-like strings
+bool DiskCache::isValidKey(const std::string &hash) {
+    return !hash.empty() && hash.size() <= 128 &&
+           std::all_of(hash.begin(), hash.end(), [](char ch) {
+               return std::isalnum(static_cast<unsigned char>(ch)) ||
+                      ch == '-' || ch == '_';
+           });
+}
+
+std::string DiskCache::pathOf(const std::string &hash) const {
+    return _directory + PATH_SEPARATOR + hash + _extension;
+}
+
+/* Inflate the blob of hash into the inflater's buffer, and append the blob to
+compressed if given. Returns false (and leaves the buffer in an unspecified
+state) on a miss or an invalid blob. */
+bool DiskCache::read(const std::string &hash, BoundedInflater &inflater,
+                     std::vector<char> *compressed) {
+    std::string path = pathOf(hash);
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        ++_misses;
+        return false;
+    }
+
+    inflater.reset();
+    std::vector<char> block(1 << 20);
+    bool valid = true;
+    while (valid && file) {
+        file.read(block.data(), block.size());
+        if (file.gcount() > 0) {
+            valid = inflater.inflate(block.data(),
+                                     static_cast<size_t>(file.gcount()));
+            if (compressed) {
+                compressed->insert(compressed->end(), block.data(),
+                                   block.data() + file.gcount());
+            }
+        }
+    }
+    valid = valid && !file.bad() && inflater.finished();
+    file.close();
+
+    if (!valid) {
+        if (compressed) {
+            compressed->clear();
+        }
+        std::remove(path.c_str());
+        ++_misses;
+        return false;
+    }
+    UTIME(path.c_str());
+    ++_hits;
+    return true;
+}
+
+// A writer for the blob of hash. If the temporary file cannot be created,
+// the writer silently discards the data.
+std::unique_ptr<DiskCache::Writer> DiskCache::startWrite(const std::string &hash) {
+    std::unique_ptr<Writer> writer(new Writer(*this, hash));
+    writer->restart();
+    return writer;
+}
+
+DiskCache::Writer::Writer(DiskCache &cache, const std::string &hash)
+    : _cache(cache), _hash(hash),
+      _tempPath(cache.pathOf(hash) + "." + std::to_string(GETPID()) + "." +
+                std::to_string(cache._nextTempId++) + ".tmp"),
+      _size(0) {}
+
+DiskCache::Writer::~Writer() {
+    if (_file.is_open()) {
+        _file.close();
+        std::remove(_tempPath.c_str());
+    }
+}
+
+// Start over, e.g. when a request is retried
+void DiskCache::Writer::restart() {
+    if (_file.is_open()) {
+        _file.close();
+    }
+    _file.open(_tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    _size = 0;
+}
+
+// Write errors are not fatal, they only keep the blob from being published
+void DiskCache::Writer::write(const char *data, size_t length) {
+    if (_file.is_open()) {
+        _file.write(data, static_cast<std::streamsize>(length));
+        _size += length;
+    }
+}
+
+// Call only after the inflater verified the complete payload
+void DiskCache::Writer::publish() {
+    if (!_file.is_open()) {
+        return;
+    }
+    _file.close();
+    std::string path = _cache.pathOf(_hash);
+    if (_file.fail() || std::rename(_tempPath.c_str(), path.c_str()) != 0) {
+        // another process may have published the same blob first (rename
+        // does not replace files on Windows)
+        std::remove(_tempPath.c_str());
+        return;
+    }
+    _cache.added(_size);
+}
+
+void DiskCache::added(uint64_t size) {
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(_sizeMutex);
+        if (_knownSize != std::numeric_limits<uint64_t>::max()) {
+            _knownSize += size;
+        }
+        full = _knownSize > _maxBytes;
+    }
+    if (full) {
+        evict();
+    }
+}
+
+/* Rescan the directory and delete the least recently used blobs until it is
+below 90% of the limit, so eviction does not run after every download.
+Temporary files of writers that died are removed after a day. */
+void DiskCache::evict() {
+    std::lock_guard<std::mutex> lock(_sizeMutex);
+    std::vector<Entry> entries = listEntries();
+    time_t staleTemp = std::time(nullptr) - 24 * 60 * 60;
+
+    uint64_t total = 0;
+    std::vector<Entry> blobs;
+    for (auto &entry : entries) {
+        if (entry.temporary && entry.modified < staleTemp) {
+            std::remove(entry.path.c_str());
+            continue;
+        }
+        total += entry.size;
+        if (!entry.temporary) {
+            blobs.push_back(entry);
+        }
+    }
+
+    std::sort(blobs.begin(), blobs.end(), [](const Entry &a, const Entry &b) {
+        return a.modified < b.modified;
+    });
+    uint64_t target = _maxBytes / 10 * 9;
+    for (auto &blob : blobs) {
+        if (total <= target) {
+            break;
+        }
+        if (std::remove(blob.path.c_str()) == 0) {
+            total -= blob.size;
+        }
+    }
+    _knownSize = total;
+}
+
+/* Whether a file of the cache directory is one of ours: a blob named
+<key><extension>, or a writer's temporary file <key><extension>.<pid>.<n>.tmp.
+The directory may hold other files, which are never counted or deleted. */
+bool DiskCache::ownsFile(const std::string &name, bool &temporary) const {
+    size_t keyEnd = name.find('.');
+    if (keyEnd == std::string::npos || !isValidKey(name.substr(0, keyEnd)) ||
+        name.compare(keyEnd, _extension.size(), _extension) != 0) {
+        return false;
+    }
+    std::string suffix = name.substr(keyEnd + _extension.size());
+    temporary = !suffix.empty();
+    if (!temporary) {
+        return true;
+    }
+
+    // .<digits>.<digits>.tmp
+    const char *rest = suffix.c_str();
+    for (int number = 0; number < 2; ++number) {
+        if (*rest++ != '.' || !std::isdigit(static_cast<unsigned char>(*rest))) {
+            return false;
+        }
+        while (std::isdigit(static_cast<unsigned char>(*rest))) {
+            ++rest;
+        }
+    }
+    return std::strcmp(rest, ".tmp") == 0;
+}
+
+// The blobs and temporary files in the cache directory, see ownsFile()
+std::vector<DiskCache::Entry> DiskCache::listEntries() const {
+    std::vector<Entry> entries;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE handle =
+        FindFirstFileA((_directory + PATH_SEPARATOR + "*").c_str(), &found);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return entries;
+    }
+    do {
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+        bool temporary;
+        if (!ownsFile(found.cFileName, temporary)) {
+            continue;
+        }
+        std::string path = _directory + PATH_SEPARATOR + found.cFileName;
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            entries.push_back(Entry{path, static_cast<uint64_t>(info.st_size),
+                                    info.st_mtime, temporary});
+        }
+    } while (FindNextFileA(handle, &found));
+    FindClose(handle);
+#else
+    DIR *dir = opendir(_directory.c_str());
+    if (!dir) {
+        return entries;
+    }
+    while (struct dirent *found = readdir(dir)) {
+        bool temporary;
+        if (!ownsFile(found->d_name, temporary)) {
+            continue;
+        }
+        std::string path = _directory + PATH_SEPARATOR + found->d_name;
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            entries.push_back(Entry{path, static_cast<uint64_t>(info.st_size),
+                                    info.st_mtime, temporary});
+        }
+    }
+    closedir(dir);
+#endif
+    return entries;
+}
+
+/* Decoded data of recent downloads, kept in memory so that repeated requests
+for the same identifier are served with a memcpy. Entries are evicted least
+recently used first once they exceed the byte budget. A hit copies outside
+of the lock, so hits on different threads do not wait for each other.
+The manager also uses one to hold compressed response bodies, see get(). */
+class MemoryCache {
+  public:
+    typedef std::shared_ptr<const std::vector<char>> Data;
+
+    explicit MemoryCache(uint64_t maxBytes)
+        : _maxBytes(maxBytes), _size(0), _hits(0), _misses(0) {}
+    bool read(const std::string &key, char *buffer, size_t byteSize);
+    Data get(const std::string &key, bool countAccess = true);
+    void insert(const std::string &key, const char *data, size_t byteSize);
+    void insert(const std::string &key, Data data);
+    bool contains(const std::string &key);
+    void setMaxBytes(uint64_t maxBytes);
+    bool isEnabled() const { return _maxBytes > 0; }
+    uint64_t getMaxBytes() const { return _maxBytes; }
+    uint64_t getSize();
+    size_t getHitCount() const { return _hits; }
+    size_t getMissCount() const { return _misses; }
+
+  private:
+    typedef std::list<std::pair<std::string, Data>> Entries;
+
+    void evict();
+
+    std::mutex _mutex;
+    std::atomic<uint64_t> _maxBytes;
+    uint64_t _size;
+    // most recently used first
+    Entries _entries;
+    std::map<std::string, Entries::iterator> _index;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+};
+
+// Copy the cached data of key into buffer if it has exactly byteSize bytes
+bool MemoryCache::read(const std::string &key, char *buffer,
+                       size_t byteSize) {
+    Data data;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _index.find(key);
+        if (found != _index.end() && found->second->second->size() == byteSize) {
+            _entries.splice(_entries.begin(), _entries, found->second);
+            data = found->second->second;
+        }
+    }
+
+    if (!data) {
+        ++_misses;
+        return false;
+    }
+    if (byteSize > 0) {
+        std::memcpy(buffer, data->data(), byteSize);
+    }
+    ++_hits;
+    return true;
+}
+
+/* The cached data of key, of any size, or null. The data stays valid while
+the caller holds it, also if the entry is evicted meanwhile. */
+MemoryCache::Data MemoryCache::get(const std::string &key, bool countAccess) {
+    Data data;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _index.find(key);
+        if (found != _index.end()) {
+            _entries.splice(_entries.begin(), _entries, found->second);
+            data = found->second->second;
+        }
+    }
+    if (countAccess) {
+        ++(data ? _hits : _misses);
+    }
+    return data;
+}
+
+// Whether key is cached, without counting a hit or miss
+bool MemoryCache::contains(const std::string &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _index.count(key) > 0;
+}
+
+// Store a copy of data under key. Data larger than the budget is not cached.
+void MemoryCache::insert(const std::string &key, const char *data,
+                         size_t byteSize) {
+    if (byteSize > _maxBytes) {
+        return;
+    }
+    insert(key, std::make_shared<const std::vector<char>>(data, data + byteSize));
+}
+
+void MemoryCache::insert(const std::string &key, Data data) {
+    size_t byteSize = data->size();
+    if (byteSize > _maxBytes) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _index.find(key);
+    if (found != _index.end()) {
+        _size -= found->second->second->size();
+        _entries.erase(found->second);
+        _index.erase(found);
+    }
+    _entries.emplace_front(key, std::move(data));
+    _index[key] = _entries.begin();
+    _size += byteSize;
+    evict();
+}
+
+void MemoryCache::setMaxBytes(uint64_t maxBytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _maxBytes = maxBytes;
+    evict();
+}
+
+uint64_t MemoryCache::getSize() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _size;
+}
+
+// Drop the least recently used entries until the budget is met (lock held)
+void MemoryCache::evict() {
+    while (_size > _maxBytes && !_entries.empty()) {
+        _size -= _entries.back().second->size();
+        _index.erase(_entries.back().first);
+        _entries.pop_back();
+    }
+}
+
+#ifndef _WIN32
+/* Size a new shared memory object and allocate its pages right away. After
+only ftruncate the pages are allocated on first write, which raises SIGBUS
+once /dev/shm is full. macOS has no posix_fallocate, and its shared memory is
+not a file system that can run out. */
+inline bool reserveSharedMemory(int fd, size_t byteSize) {
+#ifdef __APPLE__
+    return ftruncate(fd, static_cast<off_t>(byteSize)) == 0;
+#else
+    return posix_fallocate(fd, 0, static_cast<off_t>(byteSize)) == 0;
+#endif
+}
+#endif
+
+/* Host-wide cache of decoded data in POSIX shared memory, shared by all
+processes of the user, e.g. the workers of a parfor pool: data that one worker
+fetched is copied, not downloaded again, by the others. An index segment holds
+a fixed-size open addressing table, and the data of every entry lives in a
+segment of its own. Lookups take no locks. Entries change state with atomic
+compare-and-swap, and only the process that owns an entry fills or evicts it.
+Readers pin an entry with their process ID while they copy, so eviction (least
+recently used first) never removes data in use. Owners and pins of processes
+that died are reclaimed by the next process that comes across them. Probing
+stops after MAX_PROBES slots, so lookups stay short when many slots were used
+and freed.
+
+The size limit is set by the process that creates the index. An index of
+another layout is replaced. removeAll() deletes the cache of the user, e.g.
+after a crash left it full; processes that have it open keep using their copy
+until they create a new one. The cache is not available on Windows. */
+class SharedMemoryCache {
+  public:
+    SharedMemoryCache(uint64_t maxBytes, size_t capacity);
+    ~SharedMemoryCache();
+    bool isEnabled() const { return _header != nullptr; }
+    bool read(const std::string &key, char *buffer, size_t byteSize);
+    void insert(const std::string &key, const char *data, size_t byteSize);
+    size_t getHitCount() const { return _hits; }
+    size_t getMissCount() const { return _misses; }
+    static void removeAll();
+
+  private:
+    enum State : uint32_t { Empty, Filling, Ready, Evicting, Deleted };
+    static const size_t MAX_KEY_SIZE = 247;
+    static const size_t MAX_PINS = 8;
+    static const size_t MAX_PROBES = 32;
+    // identifies the layout of the index, a mismatch replaces it
+    static const uint64_t MAGIC;
+
+    // Shared between processes: plain data and address-free atomics only
+    struct Slot {
+        std::atomic<uint32_t> state;
+        uint32_t keySize;
+        // process that is filling or evicting the slot, 0 if none
+        std::atomic<int32_t> owner;
+        // processes copying the data, 0 for unused pins
+        std::atomic<int32_t> pins[MAX_PINS];
+        // written once the key is complete, before the data is filled
+        std::atomic<uint64_t> keyHash;
+        std::atomic<uint64_t> byteSize;
+        uint64_t segment;
+        std::atomic<uint64_t> lastUsed;
+        char key[MAX_KEY_SIZE + 1];
+    };
+    struct Header {
+        std::atomic<uint64_t> magic;
+        uint64_t capacity;
+        uint64_t maxBytes;
+        // part of the segment names, so a replaced index never reuses them
+        uint64_t generation;
+        std::atomic<uint64_t> usedBytes;
+        std::atomic<uint64_t> clock;
+        std::atomic<uint64_t> nextSegment;
+    };
+
+    static std::string prefix();
+    static uint64_t hashOf(const std::string &key);
+    static bool isAlive(int32_t pid);
+    bool open(uint64_t maxBytes, size_t capacity);
+    bool keyEquals(const Slot &slot, const std::string &key) const;
+    std::string segmentName(uint64_t segment) const;
+    size_t probeCount() const;
+    bool takeOwnership(Slot &slot);
+    int pin(Slot &slot);
+    bool isPinned(Slot &slot);
+    bool isClaimedElsewhere(const Slot &claimed, uint64_t hash) const;
+    bool makeRoom(uint64_t byteSize);
+    void release(Slot &slot);
+    void reclaimIfAbandoned(Slot &slot);
+
+    const std::string _prefix;
+    const int32_t _pid;
+    Header *_header;
+    Slot *_slots;
+    size_t _mappedSize;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+};
+
+#ifndef _WIN32
+const uint64_t SharedMemoryCache::MAGIC =
+    0x42444d5332000000ULL | sizeof(SharedMemoryCache::Slot);
+
+SharedMemoryCache::SharedMemoryCache(uint64_t maxBytes, size_t capacity)
+    : _prefix(prefix()), _pid(static_cast<int32_t>(getpid())),
+      _header(nullptr), _slots(nullptr), _mappedSize(0), _hits(0),
+      _misses(0) {
+    // an index left by another version is unlinked and created anew
+    if (!open(maxBytes, capacity)) {
+        shm_unlink((_prefix + "index").c_str());
+        open(maxBytes, capacity);
+    }
+}
+
+SharedMemoryCache::~SharedMemoryCache() {
+    if (_header) {
+        munmap(_header, _mappedSize);
+    }
+}
+
+std::string SharedMemoryCache::prefix() {
+    return "/bdms2-" + std::to_string(getuid()) + "-";
+}
+
+/* Map the index, creating it if there is none. Returns false if an index
+exists with another layout. */
+bool SharedMemoryCache::open(uint64_t maxBytes, size_t capacity) {
+    std::string name = _prefix + "index";
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool creator = fd >= 0;
+    size_t size = sizeof(Header) + capacity * sizeof(Slot);
+    if (creator) {
+        if (!reserveSharedMemory(fd, size)) {
+            close(fd);
+            shm_unlink(name.c_str());
+            return true;
+        }
+    } else {
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            return true;
+        }
+        // the creator may still be sizing it
+        struct stat info;
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        size = static_cast<size_t>(info.st_size);
+    }
+
+    void *mapped = size >= sizeof(Header)
+                       ? mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0)
+                       : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return size >= sizeof(Header);
+    }
+    Header *header = static_cast<Header *>(mapped);
+
+    if (creator) {
+        // shared memory starts zeroed, i.e. all atomics are 0 and all
+        // slots are Empty
+        header->capacity = capacity;
+        header->maxBytes = maxBytes;
+        header->generation =
+            static_cast<uint64_t>(
+                std::chrono::system_clock::now().time_since_epoch().count()) ^
+            static_cast<uint64_t>(_pid);
+        header->magic = MAGIC;
+    } else {
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            if (header->magic == MAGIC) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (header->magic != MAGIC || header->capacity == 0 ||
+            size < sizeof(Header) + header->capacity * sizeof(Slot)) {
+            munmap(mapped, size);
+            return false;
+        }
+    }
+
+    _header = header;
+    _slots = reinterpret_cast<Slot *>(header + 1);
+    _mappedSize = size;
+    return true;
+}
+
+// Unlink the index and the data segments of the user
+void SharedMemoryCache::removeAll() {
+    std::string start = prefix();
+    shm_unlink((start + "index").c_str());
+#ifdef __linux__
+    // the segments are files in /dev/shm; other systems keep them until
+    // reboot once their index is gone
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) {
+        return;
+    }
+    while (struct dirent *found = readdir(dir)) {
+        std::string name = std::string("/") + found->d_name;
+        if (name.compare(0, start.size(), start) == 0) {
+            shm_unlink(name.c_str());
+        }
+    }
+    closedir(dir);
+#endif
+}
+
+// FNV-1a, never 0, which marks a slot without key
+uint64_t SharedMemoryCache::hashOf(const std::string &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char ch : key) {
+        hash = (hash ^ ch) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+bool SharedMemoryCache::isAlive(int32_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+}
+
+bool SharedMemoryCache::keyEquals(const Slot &slot,
+                                  const std::string &key) const {
+    return slot.keySize == key.size() &&
+           std::memcmp(slot.key, key.data(), key.size()) == 0;
+}
+
+std::string SharedMemoryCache::segmentName(uint64_t segment) const {
+    std::ostringstream name;
+    name << _prefix << std::hex << _header->generation << "-" << segment;
+    return name.str();
+}
+
+size_t SharedMemoryCache::probeCount() const {
+    return std::min<size_t>(_header->capacity, MAX_PROBES);
+}
+
+// Make this process the owner of a slot that has none, or whose owner died
+bool SharedMemoryCache::takeOwnership(Slot &slot) {
+    int32_t owner = slot.owner;
+    if (owner != 0 && (owner == _pid || isAlive(owner))) {
+        return false;
+    }
+    return slot.owner.compare_exchange_strong(owner, _pid);
+}
+
+// Returns the pin taken, or -1 if all are in use
+int SharedMemoryCache::pin(Slot &slot) {
+    for (size_t i = 0; i < MAX_PINS; ++i) {
+        int32_t unused = 0;
+        if (slot.pins[i].compare_exchange_strong(unused, _pid)) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+// Pins of processes that died are dropped
+bool SharedMemoryCache::isPinned(Slot &slot) {
+    bool pinned = false;
+    for (size_t i = 0; i < MAX_PINS; ++i) {
+        int32_t reader = slot.pins[i];
+        if (reader == 0) {
+            continue;
+        }
+        if (reader == _pid || isAlive(reader)) {
+            pinned = true;
+        } else {
+            slot.pins[i].compare_exchange_strong(reader, 0);
+        }
+    }
+    return pinned;
+}
+
+/* Copy the data of key into buffer if it is cached with exactly byteSize
+bytes. */
+bool SharedMemoryCache::read(const std::string &key, char *buffer,
+                             size_t byteSize) {
+    uint64_t hash = hashOf(key);
+    size_t capacity = _header->capacity;
+    for (size_t probe = 0; probe < probeCount(); ++probe) {
+        Slot &slot = _slots[(hash + probe) % capacity];
+        uint32_t state = slot.state;
+        if (state == Empty) {
+            break;
+        }
+        if (state != Ready || slot.keyHash != hash) {
+            continue;
+        }
+
+        // pin, then check that the entry is still (or again) the one we want
+        int pinned = pin(slot);
+        if (pinned < 0) {
+            break;
+        }
+        bool hit = false;
+        if (slot.state == Ready && slot.keyHash == hash &&
+            keyEquals(slot, key) && slot.byteSize == byteSize) {
+            int fd = shm_open(segmentName(slot.segment).c_str(), O_RDONLY, 0600);
+            if (fd >= 0) {
+                void *mapped =
+                    mmap(nullptr, byteSize, PROT_READ, MAP_SHARED, fd, 0);
+                close(fd);
+                if (mapped != MAP_FAILED) {
+                    std::memcpy(buffer, mapped, byteSize);
+                    munmap(mapped, byteSize);
+                    slot.lastUsed = ++_header->clock;
+                    hit = true;
+                }
+            }
+        }
+        slot.pins[pinned] = 0;
+        if (hit) {
+            ++_hits;
+            return true;
+        }
+    }
+    ++_misses;
+    return false;
+}
+
+/* Store a copy of data under key, unless another process has it or is filling
+it already. Best effort: when the cache is full of pinned entries or shared
+memory runs out, the data is not cached. */
+void SharedMemoryCache::insert(const std::string &key, const char *data,
+                               size_t byteSize) {
+    if (byteSize == 0 || key.size() > MAX_KEY_SIZE ||
+        byteSize > _header->maxBytes) {
+        return;
+    }
+    uint64_t hash = hashOf(key);
+    size_t capacity = _header->capacity;
+
+    // present or being filled anywhere in the probe chain?
+    for (size_t probe = 0; probe < probeCount(); ++probe) {
+        Slot &slot = _slots[(hash + probe) % capacity];
+        reclaimIfAbandoned(slot);
+        uint32_t state = slot.state;
+        if (state == Empty) {
+            break;
+        }
+        if ((state == Filling || state == Ready) && slot.keyHash == hash) {
+            return;
+        }
+    }
+
+    // claim the first free slot
+    Slot *claimed = nullptr;
+    for (size_t probe = 0; probe < probeCount() && !claimed; ++probe) {
+        Slot &slot = _slots[(hash + probe) % capacity];
+        uint32_t state = slot.state;
+        if ((state != Empty && state != Deleted) || !takeOwnership(slot)) {
+            continue;
+        }
+        if (slot.state.compare_exchange_strong(state, Filling)) {
+            claimed = &slot;
+        } else {
+            slot.owner = 0;
+        }
+    }
+    if (!claimed) {
+        return;
+    }
+
+    Slot &slot = *claimed;
+    slot.segment = _header->nextSegment++;
+    slot.keySize = static_cast<uint32_t>(key.size());
+    std::memcpy(slot.key, key.data(), key.size());
+    // another process may have claimed a slot for the same key since the
+    // check above; publish ours first, so that of two such claims at least
+    // one sees the other and backs off
+    slot.keyHash = hash;
+    if (isClaimedElsewhere(slot, hash) || !makeRoom(byteSize)) {
+        release(slot);
+        return;
+    }
+    slot.byteSize = byteSize;
+
+    std::string name = segmentName(slot.segment);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool written = false;
+    if (fd >= 0) {
+        if (reserveSharedMemory(fd, byteSize)) {
+            void *mapped = mmap(nullptr, byteSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED) {
+                std::memcpy(mapped, data, byteSize);
+                munmap(mapped, byteSize);
+                written = true;
+            }
+        }
+        close(fd);
+    }
+    if (!written) {
+        release(slot);
+        return;
+    }
+
+    slot.lastUsed = ++_header->clock;
+    slot.state = Ready;
+    slot.owner = 0;
+}
+
+// Whether a slot other than ours is filling or holds the key with this hash
+bool SharedMemoryCache::isClaimedElsewhere(const Slot &claimed,
+                                           uint64_t hash) const {
+    size_t capacity = _header->capacity;
+    for (size_t probe = 0; probe < probeCount(); ++probe) {
+        const Slot &slot = _slots[(hash + probe) % capacity];
+        uint32_t state = slot.state;
+        if (state == Empty) {
+            break;
+        }
+        if (&slot != &claimed && (state == Filling || state == Ready) &&
+            slot.keyHash == hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reserve byteSize bytes, evicting unpinned entries least recently used first
+bool SharedMemoryCache::makeRoom(uint64_t byteSize) {
+    size_t capacity = _header->capacity;
+    for (size_t attempt = 0; attempt <= capacity; ++attempt) {
+        uint64_t used = _header->usedBytes;
+        if (used + byteSize <= _header->maxBytes) {
+            if (_header->usedBytes.compare_exchange_weak(used, used + byteSize)) {
+                return true;
+            }
+            continue;
+        }
+
+        Slot *oldest = nullptr;
+        for (size_t i = 0; i < capacity; ++i) {
+            Slot &slot = _slots[i];
+            reclaimIfAbandoned(slot);
+            if (slot.state == Ready && slot.owner == 0 &&
+                (!oldest || slot.lastUsed < oldest->lastUsed) &&
+                !isPinned(slot)) {
+                oldest = &slot;
+            }
+        }
+        if (!oldest) {
+            return false;
+        }
+        if (!takeOwnership(*oldest)) {
+            continue;
+        }
+        uint32_t ready = Ready;
+        if (!oldest->state.compare_exchange_strong(ready, Evicting)) {
+            oldest->owner = 0;
+            continue;
+        }
+        // a reader pins before it checks the state, so none can be copying
+        // once there are no pins here
+        if (isPinned(*oldest)) {
+            oldest->state = Ready;
+            oldest->owner = 0;
+            continue;
+        }
+        release(*oldest);
     }
+    return false;
+}
 
-  private:
-    std::mutex mutex;
-    std::condition_variable condition_variable;
-    size_t count;
-};
-
-// RAII wrapper, make on of these in your 'work-doing' class to
-// lock the critical section. once it goes out of scope the
-// critical section is unlocked
-class CriticalSection {
-  public:
-    explicit CriticalSection(Semafoor &s) : semafoor{s} { semafoor.lock(); }
-    ~CriticalSection() { semafoor.unlock(); }
+// Drop the data and reservation of a slot we own, and give up the ownership
+void SharedMemoryCache::release(Slot &slot) {
+    slot.keyHash = 0;
+    uint64_t byteSize = slot.byteSize.exchange(0);
+    if (byteSize > 0) {
+        shm_unlink(segmentName(slot.segment).c_str());
+        _header->usedBytes -= byteSize;
+    }
+    slot.state = Deleted;
+    slot.owner = 0;
+}
 
-  private:
-    Semafoor &semafoor;
-};
+// Free a slot whose owner died while filling or evicting it
+void SharedMemoryCache::reclaimIfAbandoned(Slot &slot) {
+    if (slot.owner == 0 || !takeOwnership(slot)) {
+        return;
+    }
+    uint32_t state = slot.state;
+    if (state == Filling || state == Evicting) {
+        release(slot);
+    } else {
+        slot.owner = 0;
+    }
+}
+#else
+SharedMemoryCache::SharedMemoryCache(uint64_t, size_t)
+    : _pid(0), _header(nullptr), _slots(nullptr), _mappedSize(0), _hits(0),
+      _misses(0) {}
+SharedMemoryCache::~SharedMemoryCache() {}
+bool SharedMemoryCache::read(const std::string &, char *, size_t) {
+    return false;
+}
+void SharedMemoryCache::insert(const std::string &, const char *, size_t) {}
+void SharedMemoryCache::removeAll() {}
+#endif
 
 // Class definitions
 /* TODO: DataStats and BDMSConfig classes do not utilize our custom exception
@@ -290,6 +2539,8 @@ class DataStats {
     const size_t getDataCount() const;
     std::vector<size_t> getDimensionality() const;
     const size_t getTotalValueCount() const;
+    const size_t getTotalByteSize() const;
+    static size_t getTypeByteSize(const std::string &bdmsDataType);
     template <typename T> const T getMinValue() const;
     template <typename T> const T getMaxValue() const;
     DataStats(BDMSDataID idVal, std::string dataTypeVal,
@@ -302,6 +2553,13 @@ class DataStats {
 
 const DataStats DataStats::fromIdentifier(const BDMSDataID &bdmsDataID) {
     std::vector<std::string> identifierParts = getIdentifierParts(bdmsDataID);
+    // a truncated identifier is as unexpected as an unknown one
+    auto part = [&identifierParts](size_t index) -> const std::string & {
+        if (index >= identifierParts.size()) {
+            throw std::runtime_error("Unexpected data identifier.");
+        }
+        return identifierParts[index];
+    };
 
     std::string data_type;
     std::string data_count;
@@ -309,49 +2567,47 @@ const DataStats DataStats::fromIdentifier(const BDMSDataID &bdmsDataID) {
     std::string min_value_hex;
     std::string max_value_hex;
 
-    if (identifierParts[0] == "v1") {
-        data_type = identifierParts[1];
-        data_count = identifierParts[2];
-        zip_hash = identifierParts[3];
-        min_value_hex = identifierParts[4];
-        max_value_hex = identifierParts[5];
-    } else if (identifierParts[0] == "v2") {
-        data_type = identifierParts[2];
-        data_count = identifierParts[3];
-        zip_hash = identifierParts[4];
-        min_value_hex = identifierParts[5];
-        max_value_hex = identifierParts[6];
-    } else if (identifierParts[0] == "special") {
-        if (identifierParts[1] == "constant") {
-            data_type = identifierParts[2];
-            data_count = identifierParts[3];
-            auto value_hex = identifierParts[4];
+    if (part(0) == "v1") {
+        data_type = part(1);
+        data_count = part(2);
+        zip_hash = part(3);
+        min_value_hex = part(4);
+        max_value_hex = part(5);
+    } else if (part(0) == "v2") {
+        data_type = part(2);
+        data_count = part(3);
+        zip_hash = part(4);
+        min_value_hex = part(5);
+        max_value_hex = part(6);
+    } else if (part(0) == "special") {
+        if (part(1) == "constant") {
+            data_type = part(2);
+            data_count = part(3);
+            auto value_hex = part(4);
             zip_hash = "";
             min_value_hex = value_hex;
             max_value_hex = value_hex;
-        } else if (identifierParts[1] == "steps" ||
-                   identifierParts[1] == "range") {
-            data_type = identifierParts[2];
-            data_count = identifierParts[3];
+        } else if (part(1) == "steps" || part(1) == "range") {
+            data_type = part(2);
+            data_count = part(3);
             zip_hash = "";
-            min_value_hex = identifierParts[5];
-            max_value_hex = identifierParts[6];
-        } else if (identifierParts[1] == "bdmsv1") {
-            data_type = identifierParts[2];
-            data_count = identifierParts[3];
+            min_value_hex = part(5);
+            max_value_hex = part(6);
+        } else if (part(1) == "bdmsv1") {
+            data_type = part(2);
+            data_count = part(3);
             zip_hash = "";
-            min_value_hex = identifierParts[4];
-            max_value_hex = identifierParts[5];
+            min_value_hex = part(4);
+            max_value_hex = part(5);
         } else {
             throw std::runtime_error("Unexpected data identifier.");
         }
-    } else if (identifierParts[0] == "function" &&
-               identifierParts[1] == "region") {
-        data_type = identifierParts[2];
-        data_count = identifierParts[3];
+    } else if (part(0) == "function" && part(1) == "region") {
+        data_type = part(2);
+        data_count = part(3);
         zip_hash = "";
-        min_value_hex = identifierParts[identifierParts.size() - 2];
-        max_value_hex = identifierParts[identifierParts.size() - 1];
+        min_value_hex = part(identifierParts.size() - 2);
+        max_value_hex = part(identifierParts.size() - 1);
     } else {
         throw std::runtime_error("Unexpected data identifier.");
     }
@@ -416,6 +2672,30 @@ const size_t DataStats::getTotalValueCount() const {
     return total;
 }
 
+// 0 if the data type is not supported
+const size_t DataStats::getTotalByteSize() const {
+    return this->getTotalValueCount() * getTypeByteSize(getBDMSDataType());
+}
+
+// size in bytes of one value of the given BDMS data type, 0 if unsupported
+size_t DataStats::getTypeByteSize(const std::string &type) {
+    if (type == "bool" || type == "char" || type == "byte" || type == "int8" ||
+        type == "uint8") {
+        return sizeof(uint8_t);
+    } else if (type == "uint16" || type == "int16") {
+        return sizeof(uint16_t);
+    } else if (type == "uint32" || type == "int32") {
+        return sizeof(uint32_t);
+    } else if (type == "uint64" || type == "int64") {
+        return sizeof(uint64_t);
+    } else if (type == "float") {
+        return sizeof(float);
+    } else if (type == "double") {
+        return sizeof(double);
+    }
+    return 0;
+}
+
 std::vector<size_t> DataStats::getDimensionality() const {
     std::vector<size_t> dimensions;
     std::string remaining = this->data_type;
@@ -532,6 +2812,615 @@ template <typename T> const T DataStats::getMaxValue() const {
 //     }
 // }
 
+/* Decoded arrays as raw files that can be memory mapped, in a directory that
+is managed like the download cache (size limit, LRU eviction, files published
+by rename). A file holds a 64-byte Header, the dimensions and the source
+identifier, padding to a multiple of 64 bytes, and then the values exactly as
+they are laid out in memory (little-endian on all supported platforms). Reads
+map the file and copy the values, so a hot array loads at page cache speed
+without inflating, and the processes of a host share the pages. MATLAB can map
+a file itself with memmapfile, see getPath(). */
+class DecodedCache {
+  public:
+    struct Header {
+        char magic[8];           // "BDMSRAW1"
+        char type[16];           // value type, e.g. "uint32"
+        uint64_t valueCount;     // number of values
+        uint64_t byteSize;       // of the values
+        uint64_t dataCount;      // count of the identifier
+        uint32_t dimensionCount; // uint64_t dimensions follow the header,
+        uint32_t idSize;         // then the source identifier
+        uint32_t dataOffset;     // of the values
+        uint32_t reserved;
+    };
+
+    DecodedCache(const std::string &directory, uint64_t maxBytes)
+        : _files(directory, maxBytes, ".raw"), _hits(0), _misses(0) {}
+    bool read(const std::string &key, const DataStats &stats, char *buffer,
+              size_t byteSize);
+    void write(const std::string &key, const DataStats &stats,
+               const char *data, size_t byteSize);
+    std::string getPath(const std::string &key, const DataStats &stats,
+                        size_t &dataOffset);
+    void setMaxBytes(uint64_t maxBytes) { _files.setMaxBytes(maxBytes); }
+    bool isEnabled() const { return _files.isEnabled(); }
+    size_t getHitCount() const { return _hits; }
+    size_t getMissCount() const { return _misses; }
+
+  private:
+    static std::string fileNameOf(const std::string &key);
+    static std::string prefixOf(const std::string &key, const DataStats &stats);
+
+    DiskCache _files;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+};
+
+static_assert(sizeof(DecodedCache::Header) == 64,
+              "The header is part of the file format");
+
+// FNV-1a of the key; collisions are caught by comparing the identifier
+std::string DecodedCache::fileNameOf(const std::string &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char ch : key) {
+        hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+    }
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx",
+                  static_cast<unsigned long long>(hash));
+    return name;
+}
+
+// Everything before the values. A file is valid for key and stats if it
+// starts with exactly these bytes.
+std::string DecodedCache::prefixOf(const std::string &key,
+                                   const DataStats &stats) {
+    std::vector<size_t> dimensions = stats.getDimensionality();
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BDMSRAW1", sizeof(header.magic));
+    std::string type = stats.getBDMSDataType();
+    std::memcpy(header.type, type.data(),
+                std::min(type.size(), sizeof(header.type) - 1));
+    header.valueCount = stats.getTotalValueCount();
+    header.byteSize = stats.getTotalByteSize();
+    header.dataCount = stats.data_count;
+    header.dimensionCount = static_cast<uint32_t>(dimensions.size());
+    header.idSize = static_cast<uint32_t>(key.size());
+    size_t used = sizeof(header) + dimensions.size() * sizeof(uint64_t) +
+                  key.size();
+    header.dataOffset = static_cast<uint32_t>((used + 63) / 64 * 64);
+
+    std::string prefix(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (size_t dimension : dimensions) {
+        uint64_t value = dimension;
+        prefix.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+    prefix += key;
+    prefix.resize(header.dataOffset, '\0');
+    return prefix;
+}
+
+// Copy the values of key into buffer if a valid file for stats exists
+bool DecodedCache::read(const std::string &key, const DataStats &stats,
+                        char *buffer, size_t byteSize) {
+    std::string path = _files.pathOf(fileNameOf(key));
+    std::string prefix = prefixOf(key, stats);
+    bool valid = false;
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::string found(prefix.size(), '\0');
+    if (file.read(&found[0], found.size()) && found == prefix) {
+        file.read(buffer, static_cast<std::streamsize>(byteSize));
+        valid = static_cast<size_t>(file.gcount()) == byteSize;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 &&
+        static_cast<uint64_t>(info.st_size) == prefix.size() + byteSize) {
+        size_t fileSize = static_cast<size_t>(info.st_size);
+        void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+            const char *bytes = static_cast<const char *>(mapped);
+            valid = std::memcmp(bytes, prefix.data(), prefix.size()) == 0;
+            if (valid && byteSize > 0) {
+                std::memcpy(buffer, bytes + prefix.size(), byteSize);
+            }
+            munmap(mapped, fileSize);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+    if (!valid) {
+        ++_misses;
+        return false;
+    }
+    UTIME(path.c_str());
+    ++_hits;
+    return true;
+}
+
+void DecodedCache::write(const std::string &key, const DataStats &stats,
+                         const char *data, size_t byteSize) {
+    std::string prefix = prefixOf(key, stats);
+    std::unique_ptr<DiskCache::Writer> writer =
+        _files.startWrite(fileNameOf(key));
+    writer->write(prefix.data(), prefix.size());
+    writer->write(data, byteSize);
+    writer->publish();
+}
+
+/* Path of the valid file of key, or an empty string. The values start at
+dataOffset. */
+std::string DecodedCache::getPath(const std::string &key,
+                                  const DataStats &stats, size_t &dataOffset) {
+    std::string path = _files.pathOf(fileNameOf(key));
+    std::string prefix = prefixOf(key, stats);
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::string found(prefix.size(), '\0');
+    if (!file.read(&found[0], found.size()) || found != prefix) {
+        return "";
+    }
+    UTIME(path.c_str());
+    dataOffset = prefix.size();
+    return path;
+}
+
+/* DataStats from HEAD requests, for identifiers that do not describe
+themselves. Keyed by host, session and data ID, which never change their
+data. The oldest entries are dropped once maxEntries is reached. The cache can
+be saved to and loaded from a JSON file, so it survives MATLAB restarts. */
+class StatsCache {
+  public:
+    explicit StatsCache(size_t maxEntries)
+        : _maxEntries(maxEntries), _hits(0), _misses(0) {}
+    bool find(const std::string &key, DataStats &stats);
+    void insert(const std::string &key, const DataStats &stats);
+    void load(const std::string &path);
+    void save(const std::string &path);
+    size_t getHitCount() const { return _hits; }
+    size_t getMissCount() const { return _misses; }
+
+  private:
+    std::mutex _mutex;
+    const size_t _maxEntries;
+    std::map<std::string, DataStats> _entries;
+    // keys in insertion order
+    std::deque<std::string> _order;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _misses;
+};
+
+bool StatsCache::find(const std::string &key, DataStats &stats) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _entries.find(key);
+    if (found == _entries.end()) {
+        ++_misses;
+        return false;
+    }
+    stats = found->second;
+    ++_hits;
+    return true;
+}
+
+void StatsCache::insert(const std::string &key, const DataStats &stats) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_maxEntries == 0 || !_entries.emplace(key, stats).second) {
+        return;
+    }
+    _order.push_back(key);
+    while (_order.size() > _maxEntries) {
+        _entries.erase(_order.front());
+        _order.pop_front();
+    }
+}
+
+// A missing or unreadable file leaves the cache as it is
+void StatsCache::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return;
+    }
+    try {
+        json entries = json::parse(file);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            const json &fields = it.value();
+            size_t slash = it.key().rfind('/');
+            insert(it.key(),
+                   DataStats(it.key().substr(slash + 1), fields.at(0),
+                             fields.at(1), fields.at(2), fields.at(3),
+                             fields.at(4)));
+        }
+    } catch (const std::exception &) {
+        // a damaged file is overwritten by the next save
+    }
+}
+
+// Written to a temporary file first, so a crash never leaves half a file
+void StatsCache::save(const std::string &path) {
+    json entries = json::object();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto &entry : _entries) {
+            const DataStats &stats = entry.second;
+            entries[entry.first] = {stats.data_type,
+                                    std::to_string(stats.data_count),
+                                    stats.zip_hash, stats.min_value_hex,
+                                    stats.max_value_hex};
+        }
+    }
+
+    std::string tempPath = path + "." + std::to_string(GETPID()) + ".tmp";
+    {
+        std::ofstream file(tempPath, std::ios::out | std::ios::trunc);
+        file << entries.dump();
+        if (!file) {
+            file.close();
+            std::remove(tempPath.c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    // rename does not replace files on Windows
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+    }
+}
+
+#ifndef _WIN32
+/* Messages between BrokerClient and the fetch broker (bdms_broker.cpp): a
+4-byte length in host byte order, then that many bytes of JSON. A message can
+pass one file descriptor along (SCM_RIGHTS); the broker hands fetched data
+over in an unlinked shared memory segment that way, so nothing is left behind
+when either side dies.
+
+Every request names the host and API key it is made for. The broker serves
+only its own, and answers others with "refused", upon which the client fetches
+by itself. The key is identified by its SHA-256, it is not sent along.
+
+While it works on a request, the broker sends a "heartbeat" message every
+HEARTBEAT_SECONDS, so the client can tell a long fetch from a broker that
+hangs. A client that gives up closes its connection, which cancels the
+request. */
+class BrokerProtocol {
+  public:
+    static const int HEARTBEAT_SECONDS = 5;
+
+    static bool send(int socket, const json &message, int passedFd = -1);
+    static bool receive(int socket, json &message, int *receivedFd = nullptr,
+                        const CancellationToken *cancellation = nullptr,
+                        std::chrono::steady_clock::time_point deadline =
+                            std::chrono::steady_clock::time_point::max());
+    static bool isHungUp(int socket);
+    static json identity(const std::string &baseUrl,
+                         const std::string &apiKey);
+    static json statsToJson(const DataStats &stats);
+    static DataStats statsFromJson(const BDMSDataID &bdmsDataID,
+                                   const json &fields);
+
+  private:
+    // requests and replies are small; a larger length is a corrupt frame
+    static const uint32_t MAX_MESSAGE_SIZE = 1 << 20;
+
+    static bool receiveBytes(int socket, char *data, size_t size,
+                             int *receivedFd,
+                             const CancellationToken *cancellation,
+                             std::chrono::steady_clock::time_point deadline);
+    static void closeReceived(int *receivedFd);
+};
+
+bool BrokerProtocol::send(int socket, const json &message, int passedFd) {
+    std::string payload = message.dump();
+    if (payload.size() > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    payload.insert(0, reinterpret_cast<const char *>(&length), sizeof(length));
+
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0; // SO_NOSIGPIPE is set on the socket instead
+#endif
+    size_t sent = 0;
+    while (sent < payload.size()) {
+        struct iovec data;
+        data.iov_base = &payload[sent];
+        data.iov_len = payload.size() - sent;
+        struct msghdr header;
+        std::memset(&header, 0, sizeof(header));
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+
+        // the descriptor goes along with the first byte
+        char control[CMSG_SPACE(sizeof(int))];
+        if (sent == 0 && passedFd >= 0) {
+            std::memset(control, 0, sizeof(control));
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            struct cmsghdr *fdMessage = CMSG_FIRSTHDR(&header);
+            fdMessage->cmsg_level = SOL_SOCKET;
+            fdMessage->cmsg_type = SCM_RIGHTS;
+            fdMessage->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(fdMessage), &passedFd, sizeof(int));
+        }
+
+        ssize_t written = sendmsg(socket, &header, flags);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+/* Wait for a message. Returns false if the connection failed or closed, or no
+complete message arrived before the deadline. A descriptor that came with a
+message that is not returned is closed. */
+bool BrokerProtocol::receive(int socket, json &message, int *receivedFd,
+                             const CancellationToken *cancellation,
+                             std::chrono::steady_clock::time_point deadline) {
+    if (receivedFd) {
+        *receivedFd = -1;
+    }
+    bool received = false;
+    try {
+        uint32_t length;
+        std::string payload;
+        if (receiveBytes(socket, reinterpret_cast<char *>(&length),
+                         sizeof(length), receivedFd, cancellation, deadline) &&
+            length <= MAX_MESSAGE_SIZE) {
+            payload.resize(length);
+            if (receiveBytes(socket, &payload[0], length, receivedFd,
+                             cancellation, deadline)) {
+                message = json::parse(payload);
+                received = true;
+            }
+        }
+    } catch (const json::exception &) {
+        received = false;
+    } catch (...) {
+        closeReceived(receivedFd);
+        throw;
+    }
+    if (!received) {
+        closeReceived(receivedFd);
+    }
+    return received;
+}
+
+void BrokerProtocol::closeReceived(int *receivedFd) {
+    if (receivedFd && *receivedFd >= 0) {
+        close(*receivedFd);
+        *receivedFd = -1;
+    }
+}
+
+bool BrokerProtocol::receiveBytes(
+    int socket, char *data, size_t size, int *receivedFd,
+    const CancellationToken *cancellation,
+    std::chrono::steady_clock::time_point deadline) {
+    size_t received = 0;
+    while (received < size) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        // wake up regularly to check for cancellation
+        struct pollfd readable;
+        readable.fd = socket;
+        readable.events = POLLIN;
+        readable.revents = 0;
+        if (cancellation) {
+            cancellation->check();
+        }
+        int ready = poll(&readable, 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        struct iovec buffer;
+        buffer.iov_base = data + received;
+        buffer.iov_len = size - received;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr header;
+        std::memset(&header, 0, sizeof(header));
+        header.msg_iov = &buffer;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+
+        ssize_t count = recvmsg(socket, &header, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        for (struct cmsghdr *fdMessage = CMSG_FIRSTHDR(&header); fdMessage;
+             fdMessage = CMSG_NXTHDR(&header, fdMessage)) {
+            if (fdMessage->cmsg_level == SOL_SOCKET &&
+                fdMessage->cmsg_type == SCM_RIGHTS) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(fdMessage), sizeof(int));
+                if (receivedFd && *receivedFd < 0) {
+                    *receivedFd = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        received += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Whether the other side closed the connection, without blocking
+bool BrokerProtocol::isHungUp(int socket) {
+    struct pollfd state;
+    state.fd = socket;
+    state.events = POLLIN;
+    state.revents = 0;
+    if (poll(&state, 1, 0) <= 0) {
+        return false;
+    }
+    if (state.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+        return true;
+    }
+    // readable: either a message or the end of the stream
+    char next;
+    return recv(socket, &next, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+json BrokerProtocol::identity(const std::string &baseUrl,
+                              const std::string &apiKey) {
+    return {{"host", baseUrl}, {"key", httplib::detail::SHA_256(apiKey)}};
+}
+
+json BrokerProtocol::statsToJson(const DataStats &stats) {
+    return {stats.data_type, std::to_string(stats.data_count), stats.zip_hash,
+            stats.min_value_hex, stats.max_value_hex};
+}
+
+DataStats BrokerProtocol::statsFromJson(const BDMSDataID &bdmsDataID,
+                                        const json &fields) {
+    return DataStats(bdmsDataID, fields.at(0), fields.at(1), fields.at(2),
+                     fields.at(3), fields.at(4));
+}
+
+/* Client side of the fetch broker: a local process that fetches for all
+MATLAB processes of the host, so they share one connection pool, one set of
+caches and one concurrency limit. Requests take a connection from a small
+pool of idle ones, so concurrent fetch tasks do not wait for each other. A
+broker that sends neither a reply nor a heartbeat for replyTimeout counts as
+unreachable. */
+class BrokerClient {
+  public:
+    BrokerClient(const std::string &socketPath,
+                 std::chrono::seconds replyTimeout)
+        : _socketPath(socketPath), _replyTimeout(replyTimeout) {}
+    ~BrokerClient();
+    bool call(const json &request, json &reply, int *receivedFd,
+              const CancellationToken &cancellation);
+
+  private:
+    int connectSocket();
+
+    const std::string _socketPath;
+    const std::chrono::seconds _replyTimeout;
+    std::mutex _mutex;
+    std::vector<int> _idle;
+};
+
+BrokerClient::~BrokerClient() {
+    for (int socket : _idle) {
+        close(socket);
+    }
+}
+
+int BrokerClient::connectSocket() {
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (_socketPath.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::strncpy(address.sun_path, _socketPath.c_str(),
+                 sizeof(address.sun_path) - 1);
+
+    int socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFd < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(socketFd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if (connect(socketFd, reinterpret_cast<struct sockaddr *>(&address),
+                sizeof(address)) != 0) {
+        close(socketFd);
+        return -1;
+    }
+    return socketFd;
+}
+
+/* Send request and wait for the reply. Returns false if the broker cannot be
+reached or goes silent for replyTimeout; throws FetchCancelledError when
+cancelled while waiting, which closes the connection and so cancels the
+request in the broker as well. */
+bool BrokerClient::call(const json &request, json &reply, int *receivedFd,
+                        const CancellationToken &cancellation) {
+    auto deadline = std::chrono::steady_clock::now() + _replyTimeout;
+    // an idle connection may have been closed by a restarted broker, so a
+    // failure on one is retried on a new connection
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int socketFd = -1;
+        bool reused = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_idle.empty()) {
+                socketFd = _idle.back();
+                _idle.pop_back();
+                reused = true;
+            }
+        }
+        if (socketFd < 0) {
+            socketFd = connectSocket();
+            if (socketFd < 0) {
+                return false;
+            }
+        }
+
+        bool answered;
+        try {
+            answered = BrokerProtocol::send(socketFd, request);
+            while (answered) {
+                deadline = std::chrono::steady_clock::now() + _replyTimeout;
+                answered = BrokerProtocol::receive(socketFd, reply, receivedFd,
+                                                   &cancellation, deadline);
+                if (!answered || !reply.count("heartbeat")) {
+                    break;
+                }
+            }
+        } catch (...) {
+            close(socketFd);
+            throw;
+        }
+        if (answered) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _idle.push_back(socketFd);
+            return true;
+        }
+        // a late reply would be taken for the one to the next request, so
+        // the connection is not used again
+        close(socketFd);
+        if (!reused || std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+    }
+    return false;
+}
+#else
+// The broker uses Unix domain sockets, on Windows there is no broker to call
+class BrokerClient {
+  public:
+    BrokerClient(const std::string &, std::chrono::seconds) {}
+    bool call(const json &, json &, int *, const CancellationToken &) {
+        return false;
+    }
+};
+#endif
+
 /* Common, static operations for loading BDMS2 configuration values. */
 class BDMSConfig {
   private:
@@ -551,6 +3440,10 @@ class BDMSConfig {
   public:
     static BDMSResolvedConfig
     getHostTokenProtocolCertificateAgentValues(BDMSProvidedConfig provided);
+    static size_t getTuningValue(const std::string &key, size_t defaultValue);
+    static std::string getCacheDirectory();
+    static std::string getStatsCachePath();
+    static std::string getBrokerSocketPath();
 };
 
 std::string BDMSConfig::_getBDMSConfigValueByPriority(
@@ -634,12 +3527,42 @@ std::string BDMSConfig::_getBDMSEnv(const std::string &key,
     return defaultValue;
 }
 
+/* Numeric performance settings, read from the BDMS2_<key> (or BDMS_<key>)
+environment variable. Missing or malformed values give defaultValue. */
+size_t BDMSConfig::getTuningValue(const std::string &key,
+                                  size_t defaultValue) {
+    std::string value = _getBDMSEnv(key);
+    try {
+        return value.empty() ? defaultValue
+                             : static_cast<size_t>(std::stoull(value));
+    } catch (const std::exception &) {
+        return defaultValue;
+    }
+}
+
 std::string BDMSConfig::_getBDMSConfigDir() {
     std::string defaultConfigDir =
         std::string(std::getenv(HOME_DIR.c_str())) + PATH_SEPARATOR + ".bdms2";
     return _getBDMSEnv("CONFIG_DIRECTORY", defaultConfigDir);
 }
 
+// Directory of the download cache, BDMS2_CACHE_DIRECTORY overrides it
+std::string BDMSConfig::getCacheDirectory() {
+    return _getBDMSEnv("CACHE_DIRECTORY",
+                       _getBDMSConfigDir() + PATH_SEPARATOR + "cache");
+}
+
+// File that keeps the HEAD results between sessions
+std::string BDMSConfig::getStatsCachePath() {
+    return _getBDMSConfigDir() + PATH_SEPARATOR + "stats_cache.json";
+}
+
+// Socket of the fetch broker, BDMS2_BROKER_SOCKET overrides it
+std::string BDMSConfig::getBrokerSocketPath() {
+    return _getBDMSEnv("BROKER_SOCKET",
+                       _getBDMSConfigDir() + PATH_SEPARATOR + "broker.sock");
+}
+
 /* If the cert cannot be found in the expected location,
    it will be copied there from the BlueOriginRootCA.py certificate
    data. */
@@ -748,21 +3671,56 @@ BDMSResolvedConfig BDMSConfig::getHostTokenProtocolCertificateAgentValues(
 
 class BaseBDMSDataManager {
   private:
-    Semafoor _semafoor;
-    httplib::Client *client();
+    void configureClient(httplib::Client &client);
+    static AdaptiveConcurrencyLimiter::Outcome
+    classifyOutcome(const httplib::Result &result);
     std::pair<bool, std::shared_ptr<httplib::Result>>
-    request(const std::string &endpoint, const json &body, HTTPMethod method);
+    request(const std::string &endpoint, const json &body, HTTPMethod method,
+            const ResponseStream *stream = nullptr,
+            const CancellationToken *cancellation = nullptr);
 
     void getRangeValues(const BDMSDataID &bdmsDataID, DataStats stats,
-                        char *buffer, std::string type);
-    void getConstantValues(const BDMSDataID &bdmsDataID, char *buffer,
+                        char *buffer, std::string type, size_t first,
+                        size_t size);
+    void getConstantValues(const BDMSDataID &bdmsDataID,
+                           std::string constant_value_hex, char *buffer,
                            size_t size, std::string type);
     template <typename T>
-    static void fillBufferWithSequence(T *buffer, T min_value, T max_value,
-                                       T step_value);
+    void fillBufferWithSequence(T *buffer, T min_value, T max_value,
+                                T step_value, size_t first, size_t size);
+    template <typename T>
+    void fillBufferWithLinspace(T *buffer, double min_value, double max_value,
+                                bool is_forward_stepping, size_t count,
+                                size_t first, size_t size);
+    template <typename T>
+    void fillBufferWithConstant(T *buffer, T value, size_t size);
     template <typename T>
     static void assignBufferAndVector(GenericVector &vec, char *&buffer,
                                       size_t size);
+    void fetchDataInto(const SessionID &sessionID,
+                       const BDMSDataID &bdmsDataID, const DataStats &stats,
+                       char *buffer, size_t size,
+                       const CancellationToken &cancellation);
+    void downloadDataInto(const SessionID &sessionID,
+                          const BDMSDataID &bdmsDataID, const DataStats &stats,
+                          char *buffer, size_t byteSize,
+                          const CancellationToken &cancellation,
+                          std::vector<char> *compressed = nullptr);
+    bool readCompressed(const std::string &key, char *buffer, size_t byteSize);
+    void predecode(const std::string &key, size_t byteSize);
+    bool fetchFromBroker(const SessionID &sessionID,
+                         const BDMSDataID &bdmsDataID, const DataStats &stats,
+                         char *buffer, size_t byteSize,
+                         const CancellationToken &cancellation);
+    void rememberIDs(const SessionID &sessionID,
+                     const std::vector<BDMSDataID> &ids);
+    void queuePrefetches(const SessionID &sessionID,
+                         const std::vector<BDMSDataID> &ids);
+    void prefetchOne(const SessionID &sessionID, const BDMSDataID &bdmsDataID);
+    MemoryCache &prefetchTarget();
+    template <typename T>
+    void waitUntilReady(const std::future<T> &future,
+                        CancellationToken *cancellation);
 
   protected:
     std::string _apiKey;
@@ -773,90 +3731,651 @@ class BaseBDMSDataManager {
     std::pair<bool, std::shared_ptr<httplib::Result>>
     post(const std::string &endpoint, const json &body);
     std::pair<bool, std::shared_ptr<httplib::Result>>
-    head(const std::string &endpoint);
+    head(const std::string &endpoint,
+         const CancellationToken *cancellation = nullptr);
     std::pair<bool, std::shared_ptr<httplib::Result>>
     get(const std::string &endpoint);
+    std::pair<bool, std::shared_ptr<httplib::Result>>
+    get(const std::string &endpoint, const ResponseStream &stream,
+        const CancellationToken *cancellation = nullptr);
+    // The async fetch functions stop early once the token is cancelled. Without
+    // a token, they only stop when the manager is destroyed.
     std::vector<std::future<GenericVector>>
     getDataArraysAsync(const std::string &sessionID,
-                       const std::vector<std::string> &ids);
+                       const std::vector<std::string> &ids,
+                       std::shared_ptr<CancellationToken> cancellation = nullptr);
+    std::vector<std::future<void>>
+    getDataArraysIntoAsync(const SessionID &sessionID,
+                           const std::vector<BDMSDataID> &ids,
+                           const std::vector<DataStats> &stats,
+                           const std::vector<char *> &buffers,
+                           std::shared_ptr<CancellationToken> cancellation = nullptr);
+    // One identifier to fetch straight into a caller-provided buffer
+    struct FetchJob {
+        SessionID sessionID;
+        BDMSDataID bdmsDataID;
+        DataStats stats;
+        char *buffer;
+    };
+    std::vector<std::future<void>>
+    submitFetchJobs(const std::vector<FetchJob> &jobs,
+                    std::shared_ptr<CancellationToken> cancellation = nullptr);
+    // Computes the values of one kind of identifier in-process
+    struct LocalGenerator {
+        // "constant" or "range", how callers may describe the values
+        std::string kind;
+        // false for identifiers whose values are downloaded after all
+        std::function<bool(const DataStats &)> applies;
+        // values first to first + size into buffer
+        std::function<void(const DataStats &, char *, size_t, size_t)> generate;
+    };
+    void registerGenerator(const std::string &prefix, LocalGenerator generator);
+    bool isGeneratedLocally(const BDMSDataID &bdmsDataID) const;
+    std::string getGeneratedKind(const BDMSDataID &bdmsDataID) const;
+    // the download cache, e.g. to check that a download was stored
+    const DiskCache &getDiskCache() const { return *_diskCache; }
+    static std::vector<size_t>
+    largestFirstOrder(const std::vector<size_t> &costs);
+    std::vector<DataStats>
+    getAllStats(const SessionID &sessionID, const std::vector<BDMSDataID> &ids,
+                std::shared_ptr<CancellationToken> cancellation = nullptr);
+    std::vector<std::future<DataStats>>
+    getAllStatsAsync(const SessionID &sessionID,
+                     const std::vector<BDMSDataID> &ids,
+                     std::shared_ptr<CancellationToken> cancellation = nullptr);
+    std::vector<DataStats>
+    collectStats(const SessionID &sessionID, const std::vector<BDMSDataID> &ids,
+                 std::vector<std::future<DataStats>> &futures,
+                 CancellationToken *cancellation = nullptr);
+    void waitForAll(std::vector<std::future<void>> &futures,
+                    CancellationToken *cancellation = nullptr);
     const DataStats getStats(const SessionID &sessionID,
-                             const BDMSDataID &bdmsDataID);
+                             const BDMSDataID &bdmsDataID,
+                             const CancellationToken *cancellation = nullptr);
+    const DataStats headStats(const SessionID &sessionID,
+                              const BDMSDataID &bdmsDataID,
+                              const CancellationToken *cancellation = nullptr);
+    std::shared_ptr<CancellationToken> newCancellationToken() const;
+    // Polled while waiting for a batch; true cancels the batch's token
+    virtual bool interruptRequested() { return false; }
+    void prefetchRelated(const SessionID &sessionID,
+                         const std::vector<BDMSDataID> &fetchedIDs);
+
+  public:
+    // Primary constructor
+    BaseBDMSDataManager(BDMSProvidedConfig provided,
+                        std::unique_ptr<BaseBDMSExceptionHandler> error_handler)
+        : errorHandler(std::move(error_handler)),
+          _lifetime(std::make_shared<CancellationToken>()),
+          _fetchPool(FetchPool::defaultThreadCount(), 4096) {
+        BDMSResolvedConfig resolved =
+            BDMSConfig::getHostTokenProtocolCertificateAgentValues(provided);
+        _apiKey = resolved.apiKey;
+        _baseUrl = resolved.baseUrl;
+        _userAgent = resolved.userAgent;
+        _certificatePath = resolved.certificatePath;
+
+        // one connection per fetch worker is enough to never make one wait
+        _connections = httplib::detail::make_unique<ConnectionPool>(
+            _baseUrl,
+            [this](httplib::Client &client) { configureClient(client); },
+            BDMSConfig::getTuningValue("MAX_CONNECTIONS",
+                                       _fetchPool.getThreadCount()),
+            std::chrono::seconds(
+                BDMSConfig::getTuningValue("CONNECTION_IDLE_SECONDS", 60)));
+        // start low and let the limit grow as far as the server keeps up
+        _limiter = httplib::detail::make_unique<AdaptiveConcurrencyLimiter>(
+            8, 1,
+            BDMSConfig::getTuningValue("MAX_CONCURRENCY",
+                                       _fetchPool.getThreadCount()));
+        // fail fast while the host is down, and for unknown identifiers
+        _breaker = httplib::detail::make_unique<CircuitBreaker>(
+            BDMSConfig::getTuningValue("CIRCUIT_MIN_REQUESTS", 20),
+            BDMSConfig::getTuningValue("CIRCUIT_FAILURE_PERCENT", 50),
+            BDMSConfig::getTuningValue("CIRCUIT_OPEN_SECONDS", 30));
+        _negativeCache = httplib::detail::make_unique<NegativeCache>(
+            BDMSConfig::getTuningValue("NEGATIVE_CACHE_SECONDS", 60));
+        // 0 disables the caches
+        _statsCache = httplib::detail::make_unique<StatsCache>(
+            BDMSConfig::getTuningValue("STATS_CACHE_ENTRIES", 1000000));
+        _persistStats = BDMSConfig::getTuningValue("PERSIST_STATS", 0) != 0;
+        if (_persistStats) {
+            _statsCache->load(BDMSConfig::getStatsCachePath());
+        }
+        // opt-in, see bdms_broker.cpp
+        if (BDMSConfig::getTuningValue("BROKER", 0) != 0) {
+            _broker = httplib::detail::make_unique<BrokerClient>(
+                BDMSConfig::getBrokerSocketPath(),
+                std::chrono::seconds(BDMSConfig::getTuningValue(
+                    "BROKER_TIMEOUT_SECONDS", 60)));
+        }
+        // opt-in, for hosts that run many MATLAB workers
+        uint64_t sharedCacheBytes =
+            BDMSConfig::getTuningValue("SHARED_CACHE_BYTES", 0);
+        if (sharedCacheBytes > 0) {
+            _sharedCache = httplib::detail::make_unique<SharedMemoryCache>(
+                sharedCacheBytes,
+                BDMSConfig::getTuningValue("SHARED_CACHE_ENTRIES", 16384));
+        }
+        // with a shared cache, a private copy per process is a waste
+        bool shared = _sharedCache && _sharedCache->isEnabled();
+        _memoryCache = httplib::detail::make_unique<MemoryCache>(
+            BDMSConfig::getTuningValue("MEMORY_CACHE_BYTES",
+                                       shared ? 0 : 512ULL << 20));
+        // opt-in, holds about 5 to 20 times more arrays than the same memory
+        // of decoded data
+        _compressedCache = httplib::detail::make_unique<MemoryCache>(
+            BDMSConfig::getTuningValue("COMPRESSED_CACHE_BYTES", 0));
+        _predecode = BDMSConfig::getTuningValue("PREDECODE", 0) != 0;
+        _diskCache = httplib::detail::make_unique<DiskCache>(
+            BDMSConfig::getCacheDirectory(),
+            BDMSConfig::getTuningValue("CACHE_MAX_BYTES", 10ULL << 30));
+        // opt-in, decoded arrays take 5 to 20 times the disk space
+        _decodedCache = httplib::detail::make_unique<DecodedCache>(
+            BDMSConfig::getCacheDirectory() + PATH_SEPARATOR + "decoded",
+            BDMSConfig::getTuningValue("DECODED_CACHE_BYTES", 0));
+        _autoPrefetch = BDMSConfig::getTuningValue("PREFETCH", 0) != 0;
+        _describeGenerated =
+            BDMSConfig::getTuningValue("DESCRIBE_GENERATED", 0) != 0;
+        _streamingStoreBytes =
+            BDMSConfig::getTuningValue("STREAMING_STORE_BYTES", 0);
+        registerBuiltinGenerators();
+    }
+
+    // Delegating constructors
+    BaseBDMSDataManager(BDMSProvidedConfig provided)
+        : BaseBDMSDataManager(
+              provided,
+              httplib::detail::make_unique<DefaultBDMSExceptionHandler>()) {}
+    BaseBDMSDataManager()
+        : BaseBDMSDataManager(
+              BDMSProvidedConfig(),
+              httplib::detail::make_unique<DefaultBDMSExceptionHandler>()) {}
+
+    // Cancels all running fetches so the fetch pool drains quickly
+    virtual ~BaseBDMSDataManager() {
+        _lifetime->cancel();
+        if (_persistStats) {
+            _statsCache->save(BDMSConfig::getStatsCachePath());
+        }
+    }
+
+    void configure(const std::string &option, double value);
+    std::map<std::string, double> getStatistics();
+    static void resetSharedCache();
+    void prefetch(const SessionID &sessionID,
+                  const std::vector<BDMSDataID> &ids);
+    std::string getCachedArrayPath(const SessionID &sessionID,
+                                   const BDMSDataID &bdmsDataID,
+                                   size_t &dataOffset);
+    void generateValues(const BDMSDataID &bdmsDataID, size_t first,
+                        size_t count, char *buffer);
+    // whether callers should describe generated arrays instead of fetching them
+    bool describesGenerated() const { return _describeGenerated; }
+
+  private:
+    void registerBuiltinGenerators();
+    const LocalGenerator *findGenerator(const DataStats &stats) const;
+    const LocalGenerator *findGenerator(const BDMSDataID &bdmsDataID) const;
+
+    std::unique_ptr<ConnectionPool> _connections;
+    std::unique_ptr<AdaptiveConcurrencyLimiter> _limiter;
+    std::unique_ptr<CircuitBreaker> _breaker;
+    std::unique_ptr<NegativeCache> _negativeCache;
+    std::unique_ptr<StatsCache> _statsCache;
+    bool _persistStats;
+    std::unique_ptr<MemoryCache> _memoryCache;
+    // compressed response bodies, inflated on every access
+    std::unique_ptr<MemoryCache> _compressedCache;
+    std::atomic<bool> _predecode{false};
+    std::atomic<size_t> _predecoded{0};
+    std::unique_ptr<SharedMemoryCache> _sharedCache;
+    std::unique_ptr<BrokerClient> _broker;
+    std::unique_ptr<DiskCache> _diskCache;
+    std::unique_ptr<DecodedCache> _decodedCache;
+    InFlightFetches _inFlight;
+    // Prefetching: the identifiers seen per session (most recent session
+    // last), and the keys queued for prefetching
+    std::atomic<bool> _autoPrefetch{false};
+    std::mutex _prefetchMutex;
+    std::map<SessionID, std::set<BDMSDataID>> _knownIDs;
+    std::deque<SessionID> _knownSessions;
+    std::set<std::string> _prefetching;
+    std::atomic<size_t> _prefetched{0};
+    // Identifier kinds computed in-process, by their first two parts. Only
+    // changed while the manager is constructed.
+    std::map<std::string, LocalGenerator> _generators;
+    std::atomic<bool> _describeGenerated{false};
+    // constant arrays this large bypass the CPU caches, 0 never does
+    std::atomic<uint64_t> _streamingStoreBytes{0};
+    // Parent of every batch token, cancelled on destruction
+    std::shared_ptr<CancellationToken> _lifetime;
+    // Declared last so it is destroyed first: queued fetch tasks still use
+    // the members above while the pool drains.
+    FetchPool _fetchPool;
+};
+
+// Called once for every new connection of the pool
+void BaseBDMSDataManager::configureClient(httplib::Client &client) {
+    // default connection timeout is 300 seconds, which is sufficient
+    client.set_read_timeout(std::chrono::seconds(300));
+    client.set_write_timeout(std::chrono::seconds(300));
+    client.set_keep_alive(true);
+    client.set_follow_location(true);
+    client.set_bearer_token_auth(_apiKey);
+    client.set_ca_cert_path(_certificatePath, "");
+}
+
+/* Change a performance setting at runtime. Options:
+    maxConnections          connections kept open to the BDMS host
+    connectionIdleSeconds   close connections unused for this long
+    maxConcurrency          upper bound of the adaptive request limit
+    negativeCacheSeconds    how long a request that failed with HTTP 4xx fails
+                            at once when repeated, 0 disables it
+    memoryCacheBytes        memory for recently fetched data, 0 disables it
+    compressedCacheBytes    memory for the compressed data of recent downloads,
+                            which then bypass the memory cache; 0 disables it
+    predecode               1 inflates compressed data into free room of the
+                            memory cache on idle workers, 0 turns it off
+    diskCacheBytes          size limit of the download cache, 0 disables it
+    decodedCacheBytes       size limit of the decoded array files, 0 disables
+                            them
+    prefetch                1 prefetches the other known identifiers of a
+                            session after each fetch, 0 turns it off
+    describeGenerated       1 describes arrays that are generated locally, such
+                            as special:constant and special:range, instead of
+                            generating their values, where the caller
+                            supports it; 0 turns it off
+    streamingStoreBytes     constant arrays of at least this many bytes are
+                            written past the CPU caches, 0 disables it */
+void BaseBDMSDataManager::configure(const std::string &option, double value) {
+    // the casts below are undefined for NaN, Inf and values out of range, so
+    // those are rejected, as are values a double cannot count exactly
+    if (!(value >= 0 && value <= 9007199254740992.0)) {
+        errorHandler->raiseError(
+            "Invalid configuration value",
+            option + " must be a finite, non-negative number of at most 2^53.");
+        return;
+    }
+
+    if (option == "maxConnections") {
+        _connections->setMaxConnections(static_cast<size_t>(value));
+    } else if (option == "connectionIdleSeconds") {
+        // capped at ~30 years, longer would overflow the nanosecond clock
+        _connections->setIdleTimeout(
+            std::chrono::seconds(static_cast<long>(std::min(value, 1e9))));
+    } else if (option == "maxConcurrency") {
+        _limiter->setMaxLimit(static_cast<size_t>(value));
+    } else if (option == "negativeCacheSeconds") {
+        // capped like connectionIdleSeconds
+        _negativeCache->setTtl(std::min(value, 1e9));
+    } else if (option == "memoryCacheBytes") {
+        _memoryCache->setMaxBytes(static_cast<uint64_t>(value));
+    } else if (option == "compressedCacheBytes") {
+        _compressedCache->setMaxBytes(static_cast<uint64_t>(value));
+    } else if (option == "predecode") {
+        _predecode = value != 0;
+    } else if (option == "diskCacheBytes") {
+        _diskCache->setMaxBytes(static_cast<uint64_t>(value));
+    } else if (option == "decodedCacheBytes") {
+        _decodedCache->setMaxBytes(static_cast<uint64_t>(value));
+    } else if (option == "prefetch") {
+        _autoPrefetch = value != 0;
+    } else if (option == "describeGenerated") {
+        _describeGenerated = value != 0;
+    } else if (option == "streamingStoreBytes") {
+        _streamingStoreBytes = static_cast<uint64_t>(value);
+    } else {
+        errorHandler->raiseError("Unknown configuration option", option);
+    }
+}
+
+/* Delete the shared memory cache of the user, e.g. when a crashed process
+left it full. Managers created afterwards start with an empty one; existing
+ones keep using their copy. */
+void BaseBDMSDataManager::resetSharedCache() { SharedMemoryCache::removeAll(); }
+
+// Current state of the manager, for monitoring and tuning
+std::map<std::string, double> BaseBDMSDataManager::getStatistics() {
+    std::map<std::string, double> statistics;
+    statistics["concurrencyLimit"] = static_cast<double>(_limiter->getLimit());
+    statistics["requestsInFlight"] =
+        static_cast<double>(_limiter->getInFlight());
+    statistics["openConnections"] =
+        static_cast<double>(_connections->getOpenCount());
+    statistics["sharedDownloads"] =
+        static_cast<double>(_inFlight.getJoinedCount());
+    // 0 closed, 1 open, 2 half-open
+    statistics["circuitBreakerState"] =
+        static_cast<double>(_breaker->getState());
+    statistics["circuitBreakerRejections"] =
+        static_cast<double>(_breaker->getRejectedCount());
+    statistics["negativeCacheHits"] =
+        static_cast<double>(_negativeCache->getHitCount());
+    statistics["statsCacheHits"] =
+        static_cast<double>(_statsCache->getHitCount());
+    statistics["statsCacheMisses"] =
+        static_cast<double>(_statsCache->getMissCount());
+    statistics["memoryCacheBytes"] =
+        static_cast<double>(_memoryCache->getSize());
+    statistics["memoryCacheHits"] =
+        static_cast<double>(_memoryCache->getHitCount());
+    statistics["memoryCacheMisses"] =
+        static_cast<double>(_memoryCache->getMissCount());
+    if (_compressedCache->isEnabled()) {
+        statistics["compressedCacheBytes"] =
+            static_cast<double>(_compressedCache->getSize());
+        statistics["compressedCacheHits"] =
+            static_cast<double>(_compressedCache->getHitCount());
+        statistics["compressedCacheMisses"] =
+            static_cast<double>(_compressedCache->getMissCount());
+        statistics["predecodedArrays"] = static_cast<double>(_predecoded);
+    }
+    if (_sharedCache && _sharedCache->isEnabled()) {
+        statistics["sharedCacheHits"] =
+            static_cast<double>(_sharedCache->getHitCount());
+        statistics["sharedCacheMisses"] =
+            static_cast<double>(_sharedCache->getMissCount());
+    }
+    statistics["diskCacheHits"] =
+        static_cast<double>(_diskCache->getHitCount());
+    statistics["diskCacheMisses"] =
+        static_cast<double>(_diskCache->getMissCount());
+    if (_decodedCache->isEnabled()) {
+        statistics["decodedCacheHits"] =
+            static_cast<double>(_decodedCache->getHitCount());
+        statistics["decodedCacheMisses"] =
+            static_cast<double>(_decodedCache->getMissCount());
+    }
+    statistics["prefetchedArrays"] = static_cast<double>(_prefetched);
+    return statistics;
+}
+
+/* Path of the decoded cache file of an identifier (see DecodedCache), which
+is fetched first if needed, e.g. to map it with MATLAB's memmapfile. The values
+start at dataOffset. Returns an empty string if the decoded cache is disabled
+or the identifier is generated locally. The fetch runs on the fetch pool, an
+interrupt requested meanwhile cancels it with FetchCancelledError. */
+std::string BaseBDMSDataManager::getCachedArrayPath(const SessionID &sessionID,
+                                                    const BDMSDataID &bdmsDataID,
+                                                    size_t &dataOffset) {
+    if (!_decodedCache->isEnabled() || isGeneratedLocally(bdmsDataID)) {
+        return "";
+    }
+    auto cancellation = newCancellationToken();
+    std::string key = _baseUrl + "/" + sessionID + "/" + bdmsDataID;
+    DataStats stats = getAllStats(sessionID, {bdmsDataID}, cancellation)[0];
+    std::string path = _decodedCache->getPath(key, stats, dataOffset);
+    if (!path.empty()) {
+        return path;
+    }
+
+    std::vector<char> buffer(stats.getTotalByteSize());
+    auto futures = getDataArraysIntoAsync(sessionID, {bdmsDataID}, {stats},
+                                          {buffer.data()}, cancellation);
+    waitForAll(futures, cancellation.get());
+    path = _decodedCache->getPath(key, stats, dataOffset);
+    if (path.empty()) {
+        // served by another cache, which does not write the file
+        _decodedCache->write(key, stats, buffer.data(), buffer.size());
+        path = _decodedCache->getPath(key, stats, dataOffset);
+    }
+    return path;
+}
+
+/* Fetch ids of a session into the memory cache (or the compressed cache, if
+enabled) in the background, because the caller expects to ask for them soon.
+The fetches run as low priority tasks of the fetch pool. Their requests hold at
+most half of the concurrency limit and of the connections, and do not start
+while a regular request waits, so a regular fetch waits at most for the
+prefetch requests already running. They only fill free room in the cache
+instead of evicting data. A regular fetch of an identifier that is being
+prefetched joins the running download. Failures are ignored: the regular fetch
+reports them. */
+void BaseBDMSDataManager::prefetch(const SessionID &sessionID,
+                                   const std::vector<BDMSDataID> &ids) {
+    std::lock_guard<std::mutex> lock(_prefetchMutex);
+    rememberIDs(sessionID, ids);
+    queuePrefetches(sessionID, ids);
+}
+
+/* Called after a regular fetch of a session: remember the identifiers and, if
+prefetching is on, prefetch the other identifiers seen for the session. */
+void BaseBDMSDataManager::prefetchRelated(
+    const SessionID &sessionID, const std::vector<BDMSDataID> &fetchedIDs) {
+    std::lock_guard<std::mutex> lock(_prefetchMutex);
+    rememberIDs(sessionID, fetchedIDs);
+    if (!_autoPrefetch) {
+        return;
+    }
+
+    std::set<BDMSDataID> fetched(fetchedIDs.begin(), fetchedIDs.end());
+    std::vector<BDMSDataID> others;
+    for (const BDMSDataID &bdmsDataID : _knownIDs[sessionID]) {
+        if (!fetched.count(bdmsDataID)) {
+            others.push_back(bdmsDataID);
+        }
+    }
+    queuePrefetches(sessionID, others);
+}
+
+// Called with _prefetchMutex held. At most 64 sessions of up to 4096
+// identifiers are remembered.
+void BaseBDMSDataManager::rememberIDs(const SessionID &sessionID,
+                                      const std::vector<BDMSDataID> &ids) {
+    if (!_knownIDs.count(sessionID)) {
+        _knownSessions.push_back(sessionID);
+        if (_knownSessions.size() > 64) {
+            _knownIDs.erase(_knownSessions.front());
+            _knownSessions.pop_front();
+        }
+    }
+    std::set<BDMSDataID> &known = _knownIDs[sessionID];
+    for (const BDMSDataID &bdmsDataID : ids) {
+        if (known.size() >= 4096) {
+            break;
+        }
+        known.insert(bdmsDataID);
+    }
+}
 
-  public:
-    // Primary constructor
-    BaseBDMSDataManager(BDMSProvidedConfig provided,
-                        std::unique_ptr<BaseBDMSExceptionHandler> error_handler)
-        : errorHandler(std::move(error_handler)),
-          _semafoor(std::thread::hardware_concurrency() * 2) {
-        BDMSResolvedConfig resolved =
-            BDMSConfig::getHostTokenProtocolCertificateAgentValues(provided);
-        _apiKey = resolved.apiKey;
-        _baseUrl = resolved.baseUrl;
-        _userAgent = resolved.userAgent;
-        _certificatePath = resolved.certificatePath;
+// Called with _prefetchMutex held
+void BaseBDMSDataManager::queuePrefetches(const SessionID &sessionID,
+                                          const std::vector<BDMSDataID> &ids) {
+    MemoryCache &cache = prefetchTarget();
+    if (!cache.isEnabled()) {
+        return;
+    }
+    for (const BDMSDataID &bdmsDataID : ids) {
+        std::string key = sessionID + "/" + bdmsDataID;
+        if (isGeneratedLocally(bdmsDataID) || _prefetching.count(key) ||
+            cache.contains(key) || _memoryCache->contains(key)) {
+            continue;
+        }
+        try {
+            _fetchPool.submitLowPriority([this, sessionID, bdmsDataID] {
+                prefetchOne(sessionID, bdmsDataID);
+            });
+        } catch (const std::exception &) {
+            return; // the pool is shutting down
+        }
+        _prefetching.insert(key);
     }
+}
 
-    // Delegating constructors
-    BaseBDMSDataManager(BDMSProvidedConfig provided)
-        : BaseBDMSDataManager(
-              provided,
-              httplib::detail::make_unique<DefaultBDMSExceptionHandler>()) {}
-    BaseBDMSDataManager()
-        : BaseBDMSDataManager(
-              BDMSProvidedConfig(),
-              httplib::detail::make_unique<DefaultBDMSExceptionHandler>()) {}
-};
+// Downloads are kept compressed if the compressed cache is enabled
+MemoryCache &BaseBDMSDataManager::prefetchTarget() {
+    return _compressedCache->isEnabled() ? *_compressedCache : *_memoryCache;
+}
 
-httplib::Client *BaseBDMSDataManager::client() {
-    static thread_local std::unique_ptr<httplib::Client> _client =
-        httplib::detail::make_unique<httplib::Client>(_baseUrl);
-    // default connection timeout is 300 seconds, which is sufficient
-    _client->set_read_timeout(std::chrono::seconds(300));
-    _client->set_write_timeout(std::chrono::seconds(300));
-    _client->set_keep_alive(true);
-    _client->set_follow_location(true);
-    _client->set_bearer_token_auth(_apiKey);
-    _client->set_ca_cert_path(_certificatePath, "");
-    return _client.get();
+// Low priority task of prefetch()
+void BaseBDMSDataManager::prefetchOne(const SessionID &sessionID,
+                                      const BDMSDataID &bdmsDataID) {
+    std::string key = sessionID + "/" + bdmsDataID;
+    try {
+        DataStats stats = getStats(sessionID, bdmsDataID, _lifetime.get());
+        size_t byteSize = stats.getTotalByteSize();
+        size_t typeSize = DataStats::getTypeByteSize(stats.getBDMSDataType());
+        MemoryCache &cache = prefetchTarget();
+        // the compressed size is only known after the download
+        bool fits = &cache == _compressedCache.get()
+                        ? cache.getSize() < cache.getMaxBytes()
+                        : cache.getSize() + byteSize <= cache.getMaxBytes();
+        if (typeSize > 0 && fits && !cache.contains(key)) {
+            std::vector<char> buffer(byteSize);
+            fetchDataInto(sessionID, bdmsDataID, stats, buffer.data(),
+                          byteSize / typeSize, *_lifetime);
+            ++_prefetched;
+        }
+    } catch (const std::exception &) {
+    }
+
+    std::lock_guard<std::mutex> lock(_prefetchMutex);
+    _prefetching.erase(key);
+}
+
+// How a finished request attempt should steer the concurrency limit
+AdaptiveConcurrencyLimiter::Outcome
+BaseBDMSDataManager::classifyOutcome(const httplib::Result &result) {
+    switch (result.error()) {
+    case httplib::Error::Success:
+        break;
+    case httplib::Error::Read:
+    case httplib::Error::Write:
+    case httplib::Error::ConnectionTimeout:
+        return AdaptiveConcurrencyLimiter::Outcome::Overload;
+    default:
+        return AdaptiveConcurrencyLimiter::Outcome::Ignore;
+    }
+
+    if (result->status == 429 || result->status == 503) {
+        return AdaptiveConcurrencyLimiter::Outcome::Overload;
+    }
+    return result->status == 200
+               ? AdaptiveConcurrencyLimiter::Outcome::Success
+               : AdaptiveConcurrencyLimiter::Outcome::Ignore;
 }
 
 /* NOTE: this also retries "unsafe" request types automatically (e.g. POST).
 since the client doesn't support create / update / delete requests currently.
 
-If it does in the future, add a "retry_unsafe_methods" argument. */
+If it does in the future, add a "retry_unsafe_methods" argument.
+
+Throws FetchCancelledError once the cancellation token (or, without one, the
+manager) is cancelled, also while a GET is receiving or a retry is waiting. */
 std::pair<bool, std::shared_ptr<httplib::Result>>
 BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
-                             HTTPMethod method) {
+                             HTTPMethod method, const ResponseStream *stream,
+                             const CancellationToken *cancellation) {
+    const CancellationToken &token = cancellation ? *cancellation : *_lifetime;
     httplib::Headers headers = {{"User-Agent", _userAgent}};
     if (method == POST) {
         headers.emplace("Accept", "application/json");
     }
 
-    auto cl = client();
+    // a recent permanent failure of the same endpoint fails at once
+    bool cacheFailures = method != POST;
+    std::string cachedTitle, cachedMessage;
+    if (cacheFailures &&
+        _negativeCache->find(endpoint, cachedTitle, cachedMessage)) {
+        errorHandler->raiseError(cachedTitle, cachedMessage);
+        return std::make_pair(false, nullptr);
+    }
+
     std::set<int> retryStatusCodes = {429, 500, 502, 503, 504};
     const double backoffFactor = 3.0;
     const double backoffJitter = 6.0;
 
     for (int retry = 0; retry < 4; ++retry) {
+        token.check();
+
+        CircuitBreaker::Attempt attempt(*_breaker);
+        if (!attempt.isAllowed()) {
+            std::ostringstream err;
+            err << "Too many recent requests to " << _baseUrl
+                << " failed. Requests fail at once for another "
+                << std::ceil(_breaker->getSecondsUntilProbe()) << " s."
+                << "\nEndpoint: " << endpoint;
+            errorHandler->raiseError("BDMS Unavailable", err.str());
+            return std::make_pair(false, nullptr);
+        }
+
         // Make the request
         std::shared_ptr<httplib::Result> resPtr;
         {
-            // Enforce concurrency limit on HTTP requests
-            CriticalSection cs(_semafoor);
+            // Enforce concurrency limit on HTTP requests, prefetches give way
+            bool background = FetchPool::isLowPriorityTask();
+            ConcurrencyPermit permit(*_limiter, background);
+            ConnectionPool::Lease cl = _connections->acquire(background);
+            auto started = std::chrono::steady_clock::now();
+            // time until the response headers arrived
+            std::chrono::steady_clock::duration latency(0);
             if (method == POST) {
                 resPtr = std::make_shared<httplib::Result>(cl->Post(
                     endpoint, headers, body.dump(), "application/json"));
             } else if (method == HEAD) {
                 resPtr = std::make_shared<httplib::Result>(
                     cl->Head(endpoint, headers));
+            } else if (method == GET && stream) {
+                // only stream the body of a successful response, keep error
+                // bodies for the error handling below
+                int status = 0;
+                std::string errorBody;
+                resPtr = std::make_shared<httplib::Result>(cl->Get(
+                    endpoint, headers,
+                    [&status, &latency, started,
+                     stream](const httplib::Response &response) {
+                        latency = std::chrono::steady_clock::now() - started;
+                        status = response.status;
+                        if (status == 200) {
+                            stream->begin();
+                        }
+                        return true;
+                    },
+                    [&status, &errorBody, stream, &token](const char *data,
+                                                          size_t length) {
+                        if (token.isCancelled()) {
+                            return false;
+                        }
+                        if (status == 200) {
+                            return stream->receive(data, length);
+                        }
+                        errorBody.append(data, length);
+                        return true;
+                    }));
+                if (*resPtr) {
+                    (*resPtr)->body = std::move(errorBody);
+                }
             } else if (method == GET) {
                 resPtr = std::make_shared<httplib::Result>(
-                    cl->Get(endpoint, headers));
+                    cl->Get(endpoint, headers, [&token](uint64_t, uint64_t) {
+                        return !token.isCancelled();
+                    }));
+            }
+
+            // don't hand a connection in an unknown state to the next request
+            if (resPtr->error() != httplib::Error::Success) {
+                cl.discard();
+            }
+
+            if (latency == std::chrono::steady_clock::duration(0)) {
+                latency = std::chrono::steady_clock::now() - started;
             }
+            permit.latencySeconds =
+                std::chrono::duration<double>(latency).count();
+            permit.outcome = classifyOutcome(*resPtr);
+        }
+
+        // Aborted by cancellation, or by the stream consumer, which reports
+        // its own error
+        if (resPtr && resPtr->error() == httplib::Error::Canceled) {
+            token.check();
+            return std::make_pair(false, resPtr);
         }
 
         // Handle transport layer errors
         if (!resPtr || resPtr->error() != httplib::Error::Success) {
+            attempt.finish(CircuitBreaker::Outcome::Failure);
             if (retry == 3) {
                 std::ostringstream err;
                 err << "Transport layer error"
@@ -871,10 +4390,17 @@ BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
 
             double waitTime = std::pow(backoffFactor, retry) + 
                             (static_cast<double>(rand()) / RAND_MAX) * backoffJitter;
-            std::this_thread::sleep_for(std::chrono::duration<double>(waitTime));
+            if (!token.sleepFor(std::chrono::duration<double>(waitTime))) {
+                throw FetchCancelledError();
+            }
             continue;
         }
 
+        // the server answered; rate limiting is left to the limiter
+        attempt.finish((*resPtr)->status >= 500
+                           ? CircuitBreaker::Outcome::Failure
+                           : CircuitBreaker::Outcome::Success);
+
         // TODO: this doesn't extend to other endpoints that would return,
         // e.g. a 201
         if ((*resPtr)->status == 200) {
@@ -892,7 +4418,11 @@ BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
             return std::make_pair(false, resPtr);
         }
 
-        const json jsonResponse = json::parse((*resPtr)->body);
+        // error bodies are JSON, except for HEAD responses, which have none
+        json jsonResponse = json::parse((*resPtr)->body, nullptr, false);
+        if (jsonResponse.is_discarded()) {
+            jsonResponse = (*resPtr)->body;
+        }
 
         // Handle retryable status codes
         if (retryStatusCodes.find((*resPtr)->status) != retryStatusCodes.end()) {
@@ -908,8 +4438,10 @@ BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
                     waitTime = std::pow(backoffFactor, retry + 1) + 
                              (static_cast<double>(rand()) / RAND_MAX) * backoffJitter;
                 }
-                
-                std::this_thread::sleep_for(std::chrono::duration<double>(waitTime));
+
+                if (!token.sleepFor(std::chrono::duration<double>(waitTime))) {
+                    throw FetchCancelledError();
+                }
             } else if ((*resPtr)->status != 429) { // Don't show error for rate limiting
                 std::ostringstream err;
                 err << "Max retries reached (HTTP " << (*resPtr)->status << ")"
@@ -927,6 +4459,9 @@ BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
         err << "Request failed (HTTP " << (*resPtr)->status << ")"
             << "\nEndpoint: " << endpoint << "\nRequest body: " << body.dump(2)
             << "\nResponse body: " << jsonResponse.dump(2);
+        if (cacheFailures && NegativeCache::isPermanent((*resPtr)->status)) {
+            _negativeCache->insert(endpoint, "Request Failed", err.str());
+        }
         errorHandler->raiseError("Request Failed", err.str());
         return std::make_pair(false, resPtr);
     }
@@ -936,8 +4471,9 @@ BaseBDMSDataManager::request(const std::string &endpoint, const json &body,
 }
 
 std::pair<bool, std::shared_ptr<httplib::Result>>
-BaseBDMSDataManager::head(const std::string &endpoint) {
-    return request(endpoint, json({}), HEAD);
+BaseBDMSDataManager::head(const std::string &endpoint,
+                          const CancellationToken *cancellation) {
+    return request(endpoint, json({}), HEAD, nullptr, cancellation);
 }
 
 std::pair<bool, std::shared_ptr<httplib::Result>>
@@ -950,6 +4486,13 @@ BaseBDMSDataManager::get(const std::string &endpoint) {
     return request(endpoint, json({}), GET);
 }
 
+std::pair<bool, std::shared_ptr<httplib::Result>>
+BaseBDMSDataManager::get(const std::string &endpoint,
+                         const ResponseStream &stream,
+                         const CancellationToken *cancellation) {
+    return request(endpoint, json({}), GET, &stream, cancellation);
+}
+
 template <typename T>
 void BaseBDMSDataManager::assignBufferAndVector(GenericVector &vec,
                                                 char *&buffer, size_t size) {
@@ -957,29 +4500,51 @@ void BaseBDMSDataManager::assignBufferAndVector(GenericVector &vec,
     buffer = vec.buffer();
 }
 
+// Values first to first + size of the sequence, which starts at min_value
+// when stepping forward and at max_value otherwise. Large slices are filled
+// on several threads.
 template <typename T>
 void BaseBDMSDataManager::fillBufferWithSequence(T *buffer, T min_value,
-                                                 T max_value, T step_value) {
+                                                 T max_value, T step_value,
+                                                 size_t first, size_t size) {
     bool is_forward_stepping = step_value > 0;
+    T origin = is_forward_stepping ? min_value : max_value;
 
-    if (is_forward_stepping) {
-        size_t index = 0;
-        for (T value = min_value; value <= max_value; value += step_value) {
-            buffer[index] = value;
-            index++;
-        }
-    } else {
-        size_t index = 0;
-        for (T value = max_value; value >= min_value; value += step_value) {
-            buffer[index] = value;
-            index++;
-        }
+    _fetchPool.parallelFor(
+        size, SequenceGenerator::GRAIN_BYTES / sizeof(T),
+        [=](size_t begin, size_t end) {
+            SequenceGenerator::integers(buffer + begin, end - begin, origin,
+                                        step_value, first + begin);
+        });
+}
+
+/* Values first to first + size of count evenly spaced values from min_value
+to max_value (or back), like linspace. The last value is exact. */
+template <typename T>
+void BaseBDMSDataManager::fillBufferWithLinspace(T *buffer, double min_value,
+                                                 double max_value,
+                                                 bool is_forward_stepping,
+                                                 size_t count, size_t first,
+                                                 size_t size) {
+    double origin = is_forward_stepping ? min_value : max_value;
+    double last = is_forward_stepping ? max_value : min_value;
+    double delta = count > 1 ? (last - origin) / (count - 1) : 0.0;
+
+    _fetchPool.parallelFor(
+        size, SequenceGenerator::GRAIN_BYTES / sizeof(T),
+        [=](size_t begin, size_t end) {
+            SequenceGenerator::linspace(buffer + begin, end - begin, origin,
+                                        delta, first + begin);
+        });
+    if (count > 1 && first + size == count) {
+        buffer[size - 1] = static_cast<T>(last);
     }
 }
 
 void BaseBDMSDataManager::getRangeValues(const BDMSDataID &identifier,
                                          DataStats stats, char *buffer,
-                                         std::string type) {
+                                         std::string type, size_t first,
+                                         size_t size) {
     std::vector<std::string> identifierParts =
         DataStats::getIdentifierParts(identifier);
     std::string step_value_dec = identifierParts[4];
@@ -989,40 +4554,68 @@ void BaseBDMSDataManager::getRangeValues(const BDMSDataID &identifier,
         fillBufferWithSequence<uint8_t>(
             typed_buffer, stats.getMinValue<uint8_t>(),
             stats.getMaxValue<uint8_t>(),
-            static_cast<uint8_t>(std::stoul(step_value_dec)));
+            static_cast<uint8_t>(std::stoul(step_value_dec)), first, size);
     } else if (type == "uint16") {
         uint16_t *typed_buffer = reinterpret_cast<uint16_t *>(buffer);
         fillBufferWithSequence<uint16_t>(
             typed_buffer, stats.getMinValue<uint16_t>(),
             stats.getMaxValue<uint16_t>(),
-            static_cast<uint16_t>(std::stoul(step_value_dec)));
+            static_cast<uint16_t>(std::stoul(step_value_dec)), first, size);
     } else if (type == "int16") {
         int16_t *typed_buffer = reinterpret_cast<int16_t *>(buffer);
         fillBufferWithSequence<int16_t>(
             typed_buffer, stats.getMinValue<int16_t>(),
             stats.getMaxValue<int16_t>(),
-            static_cast<int16_t>(std::stoi(step_value_dec)));
+            static_cast<int16_t>(std::stoi(step_value_dec)), first, size);
     } else if (type == "uint32") {
         uint32_t *typed_buffer = reinterpret_cast<uint32_t *>(buffer);
         fillBufferWithSequence<uint32_t>(
             typed_buffer, stats.getMinValue<uint32_t>(),
-            stats.getMaxValue<uint32_t>(), std::stoul(step_value_dec));
+            stats.getMaxValue<uint32_t>(),
+            std::stoul(step_value_dec), first, size);
     } else if (type == "int32") {
         int32_t *typed_buffer = reinterpret_cast<int32_t *>(buffer);
         fillBufferWithSequence<int32_t>(
             typed_buffer, stats.getMinValue<int32_t>(),
             stats.getMaxValue<int32_t>(),
-            static_cast<uint32_t>(std::stoi(step_value_dec)));
+            static_cast<uint32_t>(std::stoi(step_value_dec)), first, size);
     } else if (type == "uint64") {
         uint64_t *typed_buffer = reinterpret_cast<uint64_t *>(buffer);
         fillBufferWithSequence<uint64_t>(
             typed_buffer, stats.getMinValue<uint64_t>(),
-            stats.getMaxValue<uint64_t>(), std::stoull(step_value_dec));
+            stats.getMaxValue<uint64_t>(),
+            std::stoull(step_value_dec), first, size);
     } else if (type == "int64") {
         int64_t *typed_buffer = reinterpret_cast<int64_t *>(buffer);
         fillBufferWithSequence<int64_t>(
             typed_buffer, stats.getMinValue<int64_t>(),
-            stats.getMaxValue<int64_t>(), std::stoll(step_value_dec));
+            stats.getMaxValue<int64_t>(),
+            std::stoll(step_value_dec), first, size);
+    }
+    // The bitwise operations of getMinValue don't work on floating point
+    // numbers, so decode the bits and reinterpret them
+    else if (type == "float") {
+        union {
+            float f;
+            uint32_t i;
+        } min_value, max_value;
+        min_value.i = stats.getMinValue<uint32_t>();
+        max_value.i = stats.getMaxValue<uint32_t>();
+        fillBufferWithLinspace<float>(
+            reinterpret_cast<float *>(buffer), min_value.f, max_value.f,
+            std::stod(step_value_dec) > 0, stats.getTotalValueCount(), first,
+            size);
+    } else if (type == "double") {
+        union {
+            double f;
+            uint64_t i;
+        } min_value, max_value;
+        min_value.i = stats.getMinValue<uint64_t>();
+        max_value.i = stats.getMaxValue<uint64_t>();
+        fillBufferWithLinspace<double>(
+            reinterpret_cast<double *>(buffer), min_value.f, max_value.f,
+            std::stod(step_value_dec) > 0, stats.getTotalValueCount(), first,
+            size);
     } else {
         errorHandler->raiseError("Unexpected BDMS data type in getRangeValues",
                                  type + " for identifier " + identifier +
@@ -1030,49 +4623,72 @@ void BaseBDMSDataManager::getRangeValues(const BDMSDataID &identifier,
     }
 }
 
+/* Fill buffer with size copies of value, on several threads when it is large.
+The output arrays are allocated uninitialized, so this is the first touch of
+their pages, and each page is placed on the memory node of the thread that
+fills it. */
+template <typename T>
+void BaseBDMSDataManager::fillBufferWithConstant(T *buffer, T value,
+                                                 size_t size) {
+    uint64_t streamingStoreBytes = _streamingStoreBytes;
+    bool streaming =
+        streamingStoreBytes > 0 && size * sizeof(T) >= streamingStoreBytes;
+
+    _fetchPool.parallelFor(
+        size, SequenceGenerator::GRAIN_BYTES / sizeof(T),
+        [=](size_t begin, size_t end) {
+            SequenceGenerator::constant(buffer + begin, end - begin, value,
+                                        streaming);
+        });
+}
+
 void BaseBDMSDataManager::getConstantValues(const BDMSDataID &identifier,
+                                            std::string constant_value_hex,
                                             char *buffer, size_t size,
                                             std::string type) {
-    std::vector<std::string> identifierParts =
-        DataStats::getIdentifierParts(identifier);
-    std::string constant_value_hex = identifierParts[4];
-
     if (type == "bool" || type == "char" || type == "byte" || type == "int8" ||
         type == "uint8") {
         uint8_t *typed_buffer = reinterpret_cast<uint8_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<uint8_t>(constant_value_hex));
+        fillBufferWithConstant<uint8_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<uint8_t>(constant_value_hex),
+            size);
     } else if (type == "uint16") {
         uint16_t *typed_buffer = reinterpret_cast<uint16_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<uint16_t>(constant_value_hex));
+        fillBufferWithConstant<uint16_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<uint16_t>(constant_value_hex),
+            size);
     } else if (type == "int16") {
         int16_t *typed_buffer = reinterpret_cast<int16_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<int16_t>(constant_value_hex));
+        fillBufferWithConstant<int16_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<int16_t>(constant_value_hex),
+            size);
     } else if (type == "uint32") {
         uint32_t *typed_buffer = reinterpret_cast<uint32_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<uint32_t>(constant_value_hex));
+        fillBufferWithConstant<uint32_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<uint32_t>(constant_value_hex),
+            size);
     } else if (type == "int32") {
         int32_t *typed_buffer = reinterpret_cast<int32_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<int32_t>(constant_value_hex));
+        fillBufferWithConstant<int32_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<int32_t>(constant_value_hex),
+            size);
     } else if (type == "uint64") {
         uint64_t *typed_buffer = reinterpret_cast<uint64_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<uint64_t>(constant_value_hex));
+        fillBufferWithConstant<uint64_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<uint64_t>(constant_value_hex),
+            size);
     } else if (type == "int64") {
         int64_t *typed_buffer = reinterpret_cast<int64_t *>(buffer);
-        std::fill_n(
-            typed_buffer, size,
-            DataStats::littleEndianHexToDecimal<int64_t>(constant_value_hex));
+        fillBufferWithConstant<int64_t>(
+            typed_buffer,
+            DataStats::littleEndianHexToDecimal<int64_t>(constant_value_hex),
+            size);
     }
     // The bitwise opperations in littleEndianHexToDecimal don't work on
     // floating point numbers. The "union" trick gets around that problem.
@@ -1083,7 +4699,7 @@ void BaseBDMSDataManager::getConstantValues(const BDMSDataID &identifier,
             uint32_t i;
         } u;
         u.i = DataStats::littleEndianHexToDecimal<uint32_t>(constant_value_hex);
-        std::fill_n(typed_buffer, size, u.f);
+        fillBufferWithConstant(typed_buffer, u.f, size);
     } else if (type == "double") {
         double *typed_buffer = reinterpret_cast<double *>(buffer);
         union {
@@ -1091,7 +4707,7 @@ void BaseBDMSDataManager::getConstantValues(const BDMSDataID &identifier,
             uint64_t i;
         } u;
         u.i = DataStats::littleEndianHexToDecimal<uint64_t>(constant_value_hex);
-        std::fill_n(typed_buffer, size, u.f);
+        fillBufferWithConstant(typed_buffer, u.f, size);
     } else {
         errorHandler->raiseError(
             "Unexpected BDMS data type in getConstantValues",
@@ -1100,19 +4716,68 @@ void BaseBDMSDataManager::getConstantValues(const BDMSDataID &identifier,
     }
 }
 
+/* Generate values first to first + count of an identifier that is generated
+locally into buffer, which holds count values of its data type. The other
+values of the array are never generated, so callers can expand slices of
+arrays too large to hold in memory. */
+void BaseBDMSDataManager::generateValues(const BDMSDataID &bdmsDataID,
+                                         size_t first, size_t count,
+                                         char *buffer) {
+    const LocalGenerator *generator = findGenerator(bdmsDataID);
+    if (!generator) {
+        errorHandler->raiseError("Cannot generate values",
+                                 "The values of " + bdmsDataID +
+                                     " are not generated locally.");
+        return;
+    }
+
+    DataStats stats = DataStats::fromIdentifier(bdmsDataID);
+    size_t total = stats.getTotalValueCount();
+    if (first > total || count > total - first) {
+        std::ostringstream err;
+        err << "Values " << first << " to " << first + count
+            << " requested, but " << bdmsDataID << " has " << total
+            << " values.";
+        errorHandler->raiseError("Index out of range", err.str());
+        return;
+    }
+    generator->generate(stats, buffer, first, count);
+}
+
 /* This function does not care about multidimensional data.
 It is the responsibility of the caller to reshape resulting chunks. */
 std::vector<std::future<GenericVector>>
-BaseBDMSDataManager::getDataArraysAsync(const std::string &sessionID,
-                                        const std::vector<std::string> &ids) {
-    std::vector<std::future<GenericVector>> futures;
+BaseBDMSDataManager::getDataArraysAsync(
+    const std::string &sessionID, const std::vector<std::string> &ids,
+    std::shared_ptr<CancellationToken> cancellation) {
+    std::vector<std::future<GenericVector>> futures(ids.size());
+    if (!cancellation) {
+        cancellation = _lifetime;
+    }
 
-    for (auto &bdmsDataID : ids) {
-        futures.push_back(std::async(std::launch::async, [&sessionID,
-                                                          &bdmsDataID, this] {
+    // Largest first, see submitFetchJobs. Identifiers that need a HEAD
+    // request for their size count as large.
+    std::vector<size_t> costs(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        try {
+            costs[i] = isGeneratedLocally(ids[i])
+                           ? 0
+                           : DataStats::fromIdentifier(ids[i]).getTotalByteSize();
+        } catch (...) {
+            costs[i] = std::numeric_limits<size_t>::max();
+        }
+    }
+
+    for (size_t i : largestFirstOrder(costs)) {
+        const BDMSDataID &bdmsDataID = ids[i];
+        // capture by value: unlike std::async futures, pool futures do not
+        // block on destruction, so the task may outlive the caller's vector
+        futures[i] = _fetchPool.submit([sessionID, bdmsDataID, cancellation,
+                                        this] {
             GenericVector vec;
             char *buffer;
-            DataStats stats = getStats(sessionID, bdmsDataID);
+            cancellation->check();
+            DataStats stats = getStats(sessionID, bdmsDataID, cancellation.get());
             std::string type = stats.getBDMSDataType();
             size_t size = stats.getTotalValueCount();
 
@@ -1146,95 +4811,633 @@ BaseBDMSDataManager::getDataArraysAsync(const std::string &sessionID,
                 return vec; // abort further processing
             }
 
-            std::vector<std::string> identifierParts =
-                DataStats::getIdentifierParts(bdmsDataID);
-            std::string id_type_base = identifierParts[0];
-            std::string id_type_special = identifierParts[1];
-
-            if (id_type_base == "special" &&
-                (id_type_special == "steps" || id_type_special == "range")) {
-                getRangeValues(bdmsDataID, stats, buffer, type);
-            } else if (id_type_base == "special" &&
-                       id_type_special == "constant") {
-                getConstantValues(bdmsDataID, buffer, size, type);
-            } else {
-                // if data can't be generated, get from BDMS
-                std::string endpoint =
-                    "/v5/data/" + sessionID + "/" + bdmsDataID;
-                bool success;
-                std::shared_ptr<httplib::Result> res;
-                std::tie(success, res) = get(endpoint);
-
-                if (!success) {
-                    if (res && res->error() == httplib::Error::Success) {
-                        errorHandler->raiseError(
-                            "Request for getDataAsync failed",
-                            "with status code " +
-                                std::to_string((*res)->status) +
-                                " for session ID " + sessionID +
-                                " and data ID " + bdmsDataID);
-                    } else {
-                        errorHandler->raiseError(
-                            "Request for getDataAsync failed",
-                            "Reason unknown. Please contact the BDMS team.");
-                    }
-                }
+            fetchDataInto(sessionID, bdmsDataID, stats, buffer, size,
+                          *cancellation);
+            return vec;
+        });
+    }
+
+    return futures;
+}
+
+/* Zero-copy variant of getDataArraysAsync: the data of ids[i] is written
+straight into buffers[i], which must hold stats[i].getTotalByteSize() bytes and
+stay valid until the returned future is ready. Use getAllStats to size the
+buffers beforehand. */
+std::vector<std::future<void>> BaseBDMSDataManager::getDataArraysIntoAsync(
+    const SessionID &sessionID, const std::vector<BDMSDataID> &ids,
+    const std::vector<DataStats> &stats, const std::vector<char *> &buffers,
+    std::shared_ptr<CancellationToken> cancellation) {
+    std::vector<FetchJob> jobs;
+    jobs.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        jobs.push_back(FetchJob{sessionID, ids[i], stats[i], buffers[i]});
+    }
+    return submitFetchJobs(jobs, cancellation);
+}
+
+/* Submit fetch jobs (possibly of several sessions) to the fetch pool. Jobs
+are started largest download first: the batch finishes when its slowest job
+does, so a big array must not be left for last. Generated identifiers cost no
+network time and go last, to fill the gaps between downloads. The futures are
+returned in the order of the jobs. */
+std::vector<std::future<void>>
+BaseBDMSDataManager::submitFetchJobs(
+    const std::vector<FetchJob> &jobs,
+    std::shared_ptr<CancellationToken> cancellation) {
+    if (!cancellation) {
+        cancellation = _lifetime;
+    }
+    std::vector<size_t> costs(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        costs[i] = isGeneratedLocally(jobs[i].bdmsDataID)
+                       ? 0
+                       : jobs[i].stats.getTotalByteSize();
+    }
+
+    std::vector<std::future<void>> futures(jobs.size());
+    for (size_t i : largestFirstOrder(costs)) {
+        FetchJob job = jobs[i];
+        futures[i] = _fetchPool.submit([job, cancellation, this] {
+            fetchDataInto(job.sessionID, job.bdmsDataID, job.stats, job.buffer,
+                          job.stats.getTotalValueCount(), *cancellation);
+        });
+    }
+
+    return futures;
+}
+
+/* Compute the identifiers that start with prefix, e.g. "special:constant", in
+process. Identifiers the generator does not apply to, and the kinds without a
+generator, are downloaded. Subclasses register their generators in their
+constructor, before the first fetch. */
+void BaseBDMSDataManager::registerGenerator(const std::string &prefix,
+                                            LocalGenerator generator) {
+    _generators[prefix] = std::move(generator);
+}
+
+// The identifier kinds whose values follow from their parts
+void BaseBDMSDataManager::registerBuiltinGenerators() {
+    LocalGenerator range;
+    range.kind = "range";
+    range.applies = [](const DataStats &) { return true; };
+    range.generate = [this](const DataStats &stats, char *buffer, size_t first,
+                            size_t size) {
+        getRangeValues(stats.identifier, stats, buffer,
+                       stats.getBDMSDataType(), first, size);
+    };
+    registerGenerator("special:range", range);
+    registerGenerator("special:steps", range);
+
+    LocalGenerator constant;
+    constant.kind = "constant";
+    constant.applies = [](const DataStats &) { return true; };
+    constant.generate = [this](const DataStats &stats, char *buffer, size_t,
+                               size_t size) {
+        getConstantValues(stats.identifier, stats.min_value_hex, buffer, size,
+                          stats.getBDMSDataType());
+    };
+    registerGenerator("special:constant", constant);
+
+    // The other kinds only when their parts determine every value: empty
+    // arrays, and integers whose minimum equals their maximum. Floating point
+    // data may hold NaN values, which the minimum and maximum leave out.
+    LocalGenerator uniform = constant;
+    uniform.applies = [](const DataStats &stats) {
+        if (stats.getTotalValueCount() == 0) {
+            return true;
+        }
+        std::string type = stats.getBDMSDataType();
+        return type != "float" && type != "double" &&
+               DataStats::getTypeByteSize(type) > 0 &&
+               !stats.min_value_hex.empty() &&
+               stats.min_value_hex == stats.max_value_hex;
+    };
+    registerGenerator("special:bdmsv1", uniform);
+    registerGenerator("function:region", uniform);
+}
 
-                httplib::detail::gzip_decompressor comp;
-                size_t offset = 0;
-                if (!comp.decompress(
-                        (*res)->body.c_str(), (*res)->body.length(),
-                        [&offset, buffer, size](const char *decompData,
-                                                size_t decompLength) {
-                            memcpy(&buffer[offset], decompData, decompLength);
-                            offset += decompLength;
-                            return true;
-                        })) {
-
-                    errorHandler->raiseError(
-                        "Decompression failed",
-                        "Decompression failed for session ID " + sessionID +
-                            " and data ID " + bdmsDataID +
-                            ". Please contact the BDMS team.");
+// The generator of an identifier, nullptr if it is downloaded
+const BaseBDMSDataManager::LocalGenerator *
+BaseBDMSDataManager::findGenerator(const DataStats &stats) const {
+    std::vector<std::string> identifierParts =
+        DataStats::getIdentifierParts(stats.identifier);
+    if (identifierParts.size() < 2) {
+        return nullptr;
+    }
+    auto found =
+        _generators.find(identifierParts[0] + ":" + identifierParts[1]);
+    if (found == _generators.end() || !found->second.applies(stats)) {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+const BaseBDMSDataManager::LocalGenerator *
+BaseBDMSDataManager::findGenerator(const BDMSDataID &bdmsDataID) const {
+    std::vector<std::string> identifierParts =
+        DataStats::getIdentifierParts(bdmsDataID);
+    if (identifierParts.size() < 2 ||
+        !_generators.count(identifierParts[0] + ":" + identifierParts[1])) {
+        return nullptr;
+    }
+    try {
+        return findGenerator(DataStats::fromIdentifier(bdmsDataID));
+    } catch (const std::exception &) {
+        // malformed, left to the server to reject
+        return nullptr;
+    }
+}
+
+// Identifiers whose values are computed locally instead of downloaded
+bool BaseBDMSDataManager::isGeneratedLocally(
+    const BDMSDataID &bdmsDataID) const {
+    return findGenerator(bdmsDataID) != nullptr;
+}
+
+// "constant" or "range" for identifiers generated locally, "" otherwise
+std::string
+BaseBDMSDataManager::getGeneratedKind(const BDMSDataID &bdmsDataID) const {
+    const LocalGenerator *generator = findGenerator(bdmsDataID);
+    return generator ? generator->kind : "";
+}
+
+// Indices sorted by descending cost, equal costs keep their order
+std::vector<size_t>
+BaseBDMSDataManager::largestFirstOrder(const std::vector<size_t> &costs) {
+    std::vector<size_t> order(costs.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b) {
+        return costs[a] > costs[b];
+    });
+    return order;
+}
+
+/* Resolve the DataStats of all ids. Raises an error for data types that
+cannot be returned. */
+std::vector<DataStats>
+BaseBDMSDataManager::getAllStats(const SessionID &sessionID,
+                                 const std::vector<BDMSDataID> &ids,
+                                 std::shared_ptr<CancellationToken> cancellation) {
+    if (!cancellation) {
+        cancellation = _lifetime;
+    }
+    auto futures = getAllStatsAsync(sessionID, ids, cancellation);
+    return collectStats(sessionID, ids, futures, cancellation.get());
+}
+
+/* Start resolving the DataStats of all ids. Self-describing identifiers are
+parsed and cached stats are looked up in place, the HEAD requests for the
+others run concurrently on the fetch pool. Start the HEADs of all sessions of
+a batch before collecting any, so they overlap. */
+std::vector<std::future<DataStats>> BaseBDMSDataManager::getAllStatsAsync(
+    const SessionID &sessionID, const std::vector<BDMSDataID> &ids,
+    std::shared_ptr<CancellationToken> cancellation) {
+    if (!cancellation) {
+        cancellation = _lifetime;
+    }
+    std::vector<std::future<DataStats>> futures;
+    futures.reserve(ids.size());
+
+    for (auto &bdmsDataID : ids) {
+        try {
+            std::promise<DataStats> parsed;
+            parsed.set_value(DataStats::fromIdentifier(bdmsDataID));
+            futures.push_back(parsed.get_future());
+            continue;
+        } catch (...) {
+        }
+
+        DataStats cached("", "", "0", "", "", "");
+        if (_statsCache->find(_baseUrl + "/" + sessionID + "/" + bdmsDataID,
+                              cached)) {
+            std::promise<DataStats> found;
+            found.set_value(cached);
+            futures.push_back(found.get_future());
+        } else {
+            futures.push_back(_fetchPool.submit(
+                [sessionID, bdmsDataID, cancellation, this] {
+                    cancellation->check();
+                    return headStats(sessionID, bdmsDataID, cancellation.get());
+                }));
+        }
+    }
+    return futures;
+}
+
+// Wait for the futures of getAllStatsAsync and check the data types
+std::vector<DataStats>
+BaseBDMSDataManager::collectStats(const SessionID &sessionID,
+                                  const std::vector<BDMSDataID> &ids,
+                                  std::vector<std::future<DataStats>> &futures,
+                                  CancellationToken *cancellation) {
+    std::vector<DataStats> stats;
+    stats.reserve(ids.size());
+    for (size_t i = 0; i < futures.size(); ++i) {
+        waitUntilReady(futures[i], cancellation);
+        stats.push_back(futures[i].get());
+        std::string type = stats.back().getBDMSDataType();
+        if (DataStats::getTypeByteSize(type) == 0) {
+            errorHandler->raiseError(
+                "Unexpected BDMS data type in getData",
+                type + "for Session ID " + sessionID + " and data ID " +
+                    ids[i] + " is not one of the supported types.");
+        }
+    }
+    return stats;
+}
+
+/* Wait until every future is ready, then rethrow the first error (if any).
+Unlike calling get() in order, this never returns while a task may still be
+writing into a caller-owned buffer. An interrupt requested while waiting
+cancels the token. */
+void BaseBDMSDataManager::waitForAll(std::vector<std::future<void>> &futures,
+                                     CancellationToken *cancellation) {
+    std::exception_ptr firstError;
+    for (auto &future : futures) {
+        waitUntilReady(future, cancellation);
+        try {
+            future.get();
+        } catch (...) {
+            if (!firstError) {
+                firstError = std::current_exception();
+            }
+        }
+    }
+    if (firstError) {
+        std::rethrow_exception(firstError);
+    }
+}
+
+// Wait for the future, checking for interrupts in between
+template <typename T>
+void BaseBDMSDataManager::waitUntilReady(const std::future<T> &future,
+                                         CancellationToken *cancellation) {
+    while (future.wait_for(std::chrono::milliseconds(100)) !=
+           std::future_status::ready) {
+        if (cancellation && interruptRequested()) {
+            cancellation->cancel();
+        }
+    }
+}
+
+// A token for one batch of fetches, also cancelled with the manager
+std::shared_ptr<CancellationToken>
+BaseBDMSDataManager::newCancellationToken() const {
+    return std::make_shared<CancellationToken>(_lifetime);
+}
+
+// Generate or download the values of a single identifier into buffer, which
+// holds size values of the identifier's data type.
+void BaseBDMSDataManager::fetchDataInto(const SessionID &sessionID,
+                                        const BDMSDataID &bdmsDataID,
+                                        const DataStats &stats, char *buffer,
+                                        size_t size,
+                                        const CancellationToken &cancellation) {
+    cancellation.check();
+    std::string type = stats.getBDMSDataType();
+
+    const LocalGenerator *generator = findGenerator(stats);
+    if (generator) {
+        generator->generate(stats, buffer, 0, size);
+    } else {
+        // if data can't be generated, get from memory or BDMS. Concurrent
+        // requests for the same data (or the same compressed payload) share
+        // one download.
+        std::vector<std::string> keys = {sessionID + "/" + bdmsDataID};
+        if (!stats.zip_hash.empty()) {
+            keys.push_back("zip:" + stats.zip_hash);
+        }
+        size_t byteSize = size * DataStats::getTypeByteSize(type);
+        bool useMemoryCache = _memoryCache->isEnabled();
+        if (useMemoryCache && _memoryCache->read(keys[0], buffer, byteSize)) {
+            return;
+        }
+        bool useCompressedCache = _compressedCache->isEnabled();
+        if (useCompressedCache && readCompressed(keys[0], buffer, byteSize)) {
+            return;
+        }
+        // other processes may talk to another host
+        std::string sharedKey = _baseUrl + "/" + keys[0];
+        bool useSharedCache = _sharedCache && _sharedCache->isEnabled();
+        if (useSharedCache && _sharedCache->read(sharedKey, buffer, byteSize)) {
+            if (useMemoryCache) {
+                _memoryCache->insert(keys[0], buffer, byteSize);
+            }
+            return;
+        }
+        bool useDecodedCache = _decodedCache->isEnabled();
+        if (useDecodedCache &&
+            _decodedCache->read(sharedKey, stats, buffer, byteSize)) {
+            return;
+        }
+
+        bool leader;
+        auto flight = _inFlight.joinOrLead(keys, byteSize, leader);
+        // a cancelled leader leaves the download to the next one in line
+        while (!leader) {
+            if (InFlightFetches::wait(*flight, buffer)) {
+                return;
+            }
+            cancellation.check();
+            flight = _inFlight.joinOrLead(keys, byteSize, leader);
+        }
+
+        std::exception_ptr error;
+        std::vector<char> compressed;
+        try {
+            downloadDataInto(sessionID, bdmsDataID, stats, buffer, byteSize,
+                             cancellation,
+                             useCompressedCache ? &compressed : nullptr);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (!error && !compressed.empty()) {
+            // keep the compressed body instead of the decoded data
+            _compressedCache->insert(
+                keys[0],
+                std::make_shared<const std::vector<char>>(std::move(compressed)));
+            if (_predecode) {
+                std::string key = keys[0];
+                try {
+                    _fetchPool.submitLowPriority(
+                        [this, key, byteSize] { predecode(key, byteSize); });
+                } catch (const std::exception &) {
+                    // the pool is shutting down
                 }
             }
-            return vec;
-        }));
+        } else if (!error && useMemoryCache) {
+            _memoryCache->insert(keys[0], buffer, byteSize);
+        }
+        if (!error && useSharedCache) {
+            _sharedCache->insert(sharedKey, buffer, byteSize);
+        }
+        if (!error && useDecodedCache) {
+            _decodedCache->write(sharedKey, stats, buffer, byteSize);
+        }
+        _inFlight.finish(flight, keys, buffer, error);
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
+}
 
-    return futures;
+// Inflate the compressed body cached under key into buffer
+bool BaseBDMSDataManager::readCompressed(const std::string &key, char *buffer,
+                                         size_t byteSize) {
+    MemoryCache::Data data = _compressedCache->get(key);
+    if (!data) {
+        return false;
+    }
+    BoundedInflater inflater(buffer, byteSize);
+    return inflater.inflate(data->data(), data->size()) && inflater.finished();
+}
+
+/* Low priority task: inflate a compressed body into the memory cache ahead of
+its next access. Like a prefetch, it only uses free room of the memory
+cache. */
+void BaseBDMSDataManager::predecode(const std::string &key, size_t byteSize) {
+    if (_lifetime->isCancelled() ||
+        _memoryCache->getSize() + byteSize > _memoryCache->getMaxBytes() ||
+        _memoryCache->contains(key)) {
+        return;
+    }
+    MemoryCache::Data data = _compressedCache->get(key, false);
+    if (!data) {
+        return;
+    }
+    auto decoded = std::make_shared<std::vector<char>>(byteSize);
+    BoundedInflater inflater(decoded->data(), byteSize);
+    if (inflater.inflate(data->data(), data->size()) && inflater.finished()) {
+        _memoryCache->insert(key, decoded);
+        ++_predecoded;
+    }
+}
+
+/* Let the broker fetch the data into buffer. Returns false if there is no
+broker to talk to, so the caller downloads the data itself. */
+bool BaseBDMSDataManager::fetchFromBroker(const SessionID &sessionID,
+                                          const BDMSDataID &bdmsDataID,
+                                          const DataStats &stats, char *buffer,
+                                          size_t byteSize,
+                                          const CancellationToken &cancellation) {
+    json request = {{"op", "fetch"},
+                    {"session", sessionID},
+                    {"id", bdmsDataID},
+                    {"stats", BrokerProtocol::statsToJson(stats)},
+                    {"identity", BrokerProtocol::identity(_baseUrl, _apiKey)}};
+    json reply;
+    int dataFd = -1;
+    if (!_broker->call(request, reply, &dataFd, cancellation)) {
+        return false;
+    }
+    // the broker fetches for another host or API key
+    if (reply.count("refused")) {
+#ifndef _WIN32
+        if (dataFd >= 0) {
+            close(dataFd);
+        }
+#endif
+        return false;
+    }
+
+    // nothing may throw before the descriptor is closed
+    std::string error;
+    try {
+        if (reply.count("error")) {
+            error = reply["error"].get<std::string>();
+        } else if (reply.value("byteSize", uint64_t(0)) != byteSize ||
+                   (byteSize > 0 && dataFd < 0)) {
+            error =
+                "unexpected reply for " + std::to_string(byteSize) + " bytes";
+        }
+    } catch (const std::exception &e) {
+        error = e.what();
+    }
+#ifndef _WIN32
+    if (error.empty() && byteSize > 0) {
+        void *mapped = mmap(nullptr, byteSize, PROT_READ, MAP_SHARED, dataFd, 0);
+        if (mapped == MAP_FAILED) {
+            error = "cannot map the shared data";
+        } else {
+            std::memcpy(buffer, mapped, byteSize);
+            munmap(mapped, byteSize);
+        }
+    }
+    if (dataFd >= 0) {
+        close(dataFd);
+    }
+#endif
+
+    if (!error.empty()) {
+        errorHandler->raiseError("Broker request failed",
+                                 "for session ID " + sessionID +
+                                     " and data ID " + bdmsDataID + ": " +
+                                     error);
+    }
+    return true;
+}
+
+// Download and inflate the data of one identifier into buffer, which holds
+// exactly byteSize bytes. Payloads with a zip hash go through the disk cache.
+// With a broker, the broker downloads (and caches) instead.
+void BaseBDMSDataManager::downloadDataInto(const SessionID &sessionID,
+                                           const BDMSDataID &bdmsDataID,
+                                           const DataStats &stats,
+                                           char *buffer, size_t byteSize,
+                                           const CancellationToken &cancellation,
+                                           std::vector<char> *compressed) {
+    const std::string &zipHash = stats.zip_hash;
+    BoundedInflater inflater(buffer, byteSize);
+    bool useDiskCache = _diskCache->isEnabled() && DiskCache::isValidKey(zipHash);
+    if (useDiskCache && _diskCache->read(zipHash, inflater, compressed)) {
+        return;
+    }
+    if (_broker && fetchFromBroker(sessionID, bdmsDataID, stats, buffer,
+                                   byteSize, cancellation)) {
+        return;
+    }
+    std::unique_ptr<DiskCache::Writer> cacheWriter;
+    if (useDiskCache) {
+        cacheWriter = _diskCache->startWrite(zipHash);
+    }
+
+    // The body is inflated block by block while it is received, so
+    // decompression overlaps the transfer and the compressed response is
+    // never held in memory.
+    std::string endpoint = "/v5/data/" + sessionID + "/" + bdmsDataID;
+
+    ResponseStream stream;
+    stream.begin = [&inflater, &cacheWriter, compressed] {
+        inflater.reset();
+        if (cacheWriter) {
+            cacheWriter->restart();
+        }
+        if (compressed) {
+            compressed->clear();
+        }
+    };
+    stream.receive = [&inflater, &cacheWriter, compressed](const char *data,
+                                                           size_t length) {
+        if (cacheWriter) {
+            cacheWriter->write(data, length);
+        }
+        if (compressed) {
+            compressed->insert(compressed->end(), data, data + length);
+        }
+        return inflater.inflate(data, length);
+    };
+
+    bool success;
+    std::shared_ptr<httplib::Result> res;
+    std::tie(success, res) = get(endpoint, stream, &cancellation);
+
+    if (!inflater.getError().empty()) {
+        errorHandler->raiseError(
+            "Decompression failed",
+            "Decompression failed for session ID " + sessionID +
+                " and data ID " + bdmsDataID + ": " + inflater.getError() +
+                ". Please contact the BDMS team.");
+    }
+
+    if (!success) {
+        if (res && res->error() == httplib::Error::Success) {
+            errorHandler->raiseError(
+                "Request for getDataAsync failed",
+                "with status code " + std::to_string((*res)->status) +
+                    " for session ID " + sessionID + " and data ID " +
+                    bdmsDataID);
+        } else {
+            errorHandler->raiseError(
+                "Request for getDataAsync failed",
+                "Reason unknown. Please contact the BDMS team.");
+        }
+    }
+
+    if (!inflater.finished()) {
+        errorHandler->raiseError(
+            "Decompression failed",
+            "Received " + std::to_string(inflater.getWrittenSize()) +
+                " of " + std::to_string(byteSize) +
+                " expected bytes for session ID " + sessionID +
+                " and data ID " + bdmsDataID +
+                ". Please contact the BDMS team.");
+    }
+
+    // the inflater verified the payload, it can be served from disk now
+    if (cacheWriter) {
+        cacheWriter->publish();
+    }
 }
 
-const DataStats BaseBDMSDataManager::getStats(const SessionID &sessionID,
-                                              const BDMSDataID &bdmsDataID) {
+const DataStats
+BaseBDMSDataManager::getStats(const SessionID &sessionID,
+                              const BDMSDataID &bdmsDataID,
+                              const CancellationToken *cancellation) {
     try {
         DataStats stats = DataStats::fromIdentifier(bdmsDataID);
         return stats;
     } catch (...) {
-        // Make HEAD request for data
-        std::string baseEndpoint = "/v5/data/";
-        std::ostringstream urlStream;
-        urlStream << baseEndpoint << sessionID << "/" << bdmsDataID;
-
-        bool success;
-        std::shared_ptr<httplib::Result> response;
-        std::tie(success, response) = head(urlStream.str());
-        if (!success) {
-            const std::string errorMessage =
-                "Request for getStatsHead for session ID " + sessionID +
-                " and data ID " + bdmsDataID + " failed.";
-            errorHandler->raiseError("getStats error", errorMessage);
-        }
-        const json headers = (*response)->headers;
-        // default to ""
-        std::string data_type = headers.value("x-data-type", "");
-        std::string data_count = headers.value("x-data-count", "");
-        std::string zip_hash = headers.value("x-zip-hash", "");
-        std::string min_value_hex = headers.value("x-min-value", "");
-        std::string max_value_hex = headers.value("x-max-value", "");
-
-        DataStats stats(bdmsDataID, data_type, data_count, zip_hash,
-                        min_value_hex, max_value_hex);
+        DataStats cached("", "", "0", "", "", "");
+        if (_statsCache->find(_baseUrl + "/" + sessionID + "/" + bdmsDataID,
+                              cached)) {
+            return cached;
+        }
+        return headStats(sessionID, bdmsDataID, cancellation);
+    }
+}
+
+// Request the DataStats of an identifier with a HEAD request and cache them
+const DataStats
+BaseBDMSDataManager::headStats(const SessionID &sessionID,
+                               const BDMSDataID &bdmsDataID,
+                               const CancellationToken *cancellation) {
+    json request = {{"op", "stats"},
+                    {"session", sessionID},
+                    {"id", bdmsDataID},
+                    {"identity", BrokerProtocol::identity(_baseUrl, _apiKey)}};
+    json reply;
+    if (_broker &&
+        _broker->call(request, reply, nullptr,
+                      cancellation ? *cancellation : *_lifetime) &&
+        !reply.count("refused")) {
+        if (reply.count("error")) {
+            errorHandler->raiseError("getStats error",
+                                     reply["error"].get<std::string>());
+        }
+        DataStats stats =
+            BrokerProtocol::statsFromJson(bdmsDataID, reply.at("stats"));
+        _statsCache->insert(_baseUrl + "/" + sessionID + "/" + bdmsDataID,
+                            stats);
         return stats;
     }
+
+    // Make HEAD request for data
+    std::string baseEndpoint = "/v5/data/";
+    std::ostringstream urlStream;
+    urlStream << baseEndpoint << sessionID << "/" << bdmsDataID;
+
+    bool success;
+    std::shared_ptr<httplib::Result> response;
+    std::tie(success, response) = head(urlStream.str(), cancellation);
+    if (!success) {
+        const std::string errorMessage =
+            "Request for getStatsHead for session ID " + sessionID +
+            " and data ID " + bdmsDataID + " failed.";
+        errorHandler->raiseError("getStats error", errorMessage);
+    }
+    const json headers = (*response)->headers;
+    // default to ""
+    std::string data_type = headers.value("x-data-type", "");
+    std::string data_count = headers.value("x-data-count", "");
+    std::string zip_hash = headers.value("x-zip-hash", "");
+    std::string min_value_hex = headers.value("x-min-value", "");
+    std::string max_value_hex = headers.value("x-max-value", "");
+
+    DataStats stats(bdmsDataID, data_type, data_count, zip_hash,
+                    min_value_hex, max_value_hex);
+    _statsCache->insert(_baseUrl + "/" + sessionID + "/" + bdmsDataID, stats);
+    return stats;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+// Benchmark of the sequence generator that fills locally generated arrays:
+// the accumulating `value += step` loop it replaced against
+// SequenceGenerator::integers and linspace, single-threaded and spread over a
+// fetch pool, with memset as the memory bandwidth reference. It also reports
+// how far the accumulating loop and linspace drift from exact values.
+//
+// Usage: bdms_bench_sequence [values (200000000)] [threads (4)]
+//
+// Build with one command line:
+//   g++ -std=c++11 -O2 -pthread -I. -Ibdms2-cpp-library/include
+//       -Ibdms2-cpp-library/include/nlohmann bdms_bench_sequence.cpp
+//       -o bdms_bench_sequence -lssl -lcrypto -lz -ldl -lrt
+// using the libraries in lib/<platform>; drop -lrt on macOS. Add
+// -fno-tree-vectorize to compare against the loop as compilers that do not
+// vectorize it run it.
+
+#include "bdms_common.hpp"
+#include <iomanip>
+#include <iostream>
+
+// The loop fillBufferWithSequence used before the sequence generator
+template <typename T>
+void oldSequenceLoop(T *buffer, T min_value, T max_value, T step_value)
+{
+    size_t index = 0;
+    for (T value = min_value; value <= max_value; value += step_value)
+    {
+        buffer[index] = value;
+        index++;
+        if (value > max_value - step_value)
+            break;
+    }
+}
+
+// The accumulating loop fillBufferWithLinspace used before linspace
+template <typename T>
+void oldLinspaceLoop(T *buffer, size_t size, double origin, double delta)
+{
+    double value = origin;
+    for (size_t index = 0; index < size; ++index)
+    {
+        buffer[index] = static_cast<T>(value);
+        value += delta;
+    }
+}
+
+template <typename F>
+double seconds(F body)
+{
+    auto start = std::chrono::steady_clock::now();
+    body();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const std::string &name, size_t bytes, double elapsed)
+{
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2) << std::setw(8)
+              << bytes / elapsed / 1e9 << " GB/s" << std::endl;
+}
+
+// Both loops must produce the same values before their speed means anything
+template <typename T>
+bool sameAsOldLoop(T origin, T step, size_t size)
+{
+    std::vector<T> expected(size), generated(size);
+    oldSequenceLoop<T>(expected.data(), origin, static_cast<T>(origin + (size - 1) * step), step);
+    SequenceGenerator::integers(generated.data(), size, origin, step, 0);
+    return expected == generated;
+}
+
+template <typename T>
+void benchIntegers(const std::string &type, size_t count, FetchPool &pool)
+{
+    std::vector<T> buffer(count);
+    size_t bytes = count * sizeof(T);
+    // fault the pages in before timing
+    std::memset(buffer.data(), 0, bytes);
+    T last = static_cast<T>(count - 1);
+
+    report(type + " value += step", bytes, seconds([&] { oldSequenceLoop<T>(buffer.data(), 0, last, 1); }));
+    report(type + " integers", bytes, seconds([&] { SequenceGenerator::integers<T>(buffer.data(), count, 0, 1, 0); }));
+    report(type + " integers, parallel", bytes, seconds([&] {
+               pool.parallelFor(count, SequenceGenerator::GRAIN_BYTES / sizeof(T), [&](size_t begin, size_t end) {
+                   SequenceGenerator::integers<T>(buffer.data() + begin, end - begin, 0, 1, begin);
+               });
+           }));
+}
+
+template <typename T>
+void benchLinspace(const std::string &type, size_t count, FetchPool &pool)
+{
+    std::vector<T> buffer(count);
+    size_t bytes = count * sizeof(T);
+    std::memset(buffer.data(), 0, bytes);
+    double delta = 1.0 / 1024;
+
+    report(type + " value += delta", bytes, seconds([&] { oldLinspaceLoop<T>(buffer.data(), count, 0.0, delta); }));
+    report(type + " linspace", bytes, seconds([&] { SequenceGenerator::linspace<T>(buffer.data(), count, 0.0, delta, 0); }));
+    report(type + " linspace, parallel", bytes, seconds([&] {
+               pool.parallelFor(count, SequenceGenerator::GRAIN_BYTES / sizeof(T), [&](size_t begin, size_t end) {
+                   SequenceGenerator::linspace<T>(buffer.data() + begin, end - begin, 0.0, delta, begin);
+               });
+           }));
+}
+
+// Largest distance from 0 to 100 in count steps, as MATLAB's linspace(0, 100, count)
+void reportLinspaceError(size_t count)
+{
+    std::vector<double> accumulated(count), generated(count);
+    double delta = 100.0 / (count - 1);
+    oldLinspaceLoop<double>(accumulated.data(), count, 0.0, delta);
+    SequenceGenerator::linspace<double>(generated.data(), count, 0.0, delta, 0);
+
+    double accumulatedError = 0, generatedError = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        long double exact = static_cast<long double>(i) * 100 / (count - 1);
+        accumulatedError = std::max(accumulatedError, static_cast<double>(std::fabs(accumulated[i] - exact)));
+        generatedError = std::max(generatedError, static_cast<double>(std::fabs(generated[i] - exact)));
+    }
+    std::cout << std::scientific << std::setprecision(2) << "linspace(0, 100, " << count << ") max error: value += delta "
+              << accumulatedError << ", linspace " << generatedError << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? std::stoull(argv[1]) : 200000000;
+    size_t threads = argc > 2 ? std::stoull(argv[2]) : 4;
+    if (count < 2 || threads < 1)
+    {
+        std::cerr << "Usage: bdms_bench_sequence [values] [threads]" << std::endl;
+        return 1;
+    }
+
+    if (!sameAsOldLoop<uint8_t>(10, 3, 80) || !sameAsOldLoop<int16_t>(-30000, 7, 5000) ||
+        !sameAsOldLoop<int32_t>(5, 2, 100003) || !sameAsOldLoop<uint64_t>(1, 3, 10007))
+    {
+        std::cerr << "integers differs from the value += step loop" << std::endl;
+        return 1;
+    }
+    reportLinspaceError(count);
+
+    // narrower integers cannot hold a long sequence without wrapping, which
+    // the value += step loop stops at
+    FetchPool pool(threads, 4096);
+    std::cout << count << " values, " << threads << " threads" << std::endl;
+    benchIntegers<int32_t>("int32", count, pool);
+    benchIntegers<uint64_t>("uint64", count / 2, pool);
+    benchLinspace<float>("single", count, pool);
+    benchLinspace<double>("double", count / 2, pool);
+
+    std::vector<char> reference(count * 4);
+    std::memset(reference.data(), 0, reference.size());
+    report("memset", reference.size(), seconds([&] { std::memset(reference.data(), 1, reference.size()); }));
+    return 0;
+}
@@ -0,0 +1,225 @@
+// Local fetch broker: one long-running process per host that fetches BDMS data
+// for all MATLAB processes on it. They share its connection pool, caches and
+// concurrency limit instead of each opening their own connections to BDMS.
+//
+// Start it before MATLAB and set BDMS2_BROKER=1 in the environment of the
+// MATLAB processes. Both sides use ~/.bdms2/broker.sock unless
+// BDMS2_BROKER_SOCKET (or the first argument of the broker) names another
+// socket. MATLAB falls back to fetching itself while no broker is running, or
+// when the broker neither replies nor sends a heartbeat (every 5 seconds while
+// it works on a request) within BDMS2_BROKER_TIMEOUT_SECONDS (60). A request
+// stops when the MATLAB process that made it disconnects, e.g. on Ctrl-C.
+// The broker uses the host and API key of its own environment or default
+// profile, and MATLAB handles configured for another host or key fetch by
+// themselves as well.
+//
+// Build (Linux and macOS, not supported on Windows) with one command line:
+//   g++ -std=c++11 -O2 -pthread -I. -Ibdms2-cpp-library/include
+//       -Ibdms2-cpp-library/include/nlohmann bdms_broker.cpp -o bdms_broker
+//       -lssl -lcrypto -lz -ldl -lrt
+// using the libraries in lib/<platform>; drop -lrt on macOS.
+
+#include "bdms_common.hpp"
+#include <iostream>
+
+class BrokerDataManager : public BaseBDMSDataManager
+{
+public:
+    using BaseBDMSDataManager::BaseBDMSDataManager; // Inherit constructors
+
+    json handle(const json &request, int &replyFd, int clientFd);
+
+private:
+    json fetch(const SessionID &sessionID, const BDMSDataID &bdmsDataID, const DataStats &stats, int &replyFd, int clientFd);
+    template <typename T>
+    void waitForClient(std::vector<std::future<T>> &futures, int clientFd, CancellationToken &cancellation);
+
+    std::atomic<size_t> _nextSegment{0};
+};
+
+// Answer one request of clientFd, see BrokerProtocol. replyFd is set to a
+// descriptor to pass along with the reply, which the caller closes after
+// sending.
+json BrokerDataManager::handle(const json &request, int &replyFd, int clientFd)
+{
+    replyFd = -1;
+    try
+    {
+        std::string op = request.at("op");
+        SessionID sessionID = request.at("session");
+        BDMSDataID bdmsDataID = request.at("id");
+
+        // the client fetches by itself what this broker has no access to
+        if (request.value("identity", json()) != BrokerProtocol::identity(_baseUrl, _apiKey))
+            return {{"refused", "The broker only fetches for its own host and API key"}};
+
+        if (op == "stats")
+        {
+            auto cancellation = newCancellationToken();
+            auto futures = getAllStatsAsync(sessionID, {bdmsDataID}, cancellation);
+            waitForClient(futures, clientFd, *cancellation);
+            DataStats stats = collectStats(sessionID, {bdmsDataID}, futures)[0];
+            return {{"stats", BrokerProtocol::statsToJson(stats)}};
+        }
+        if (op == "fetch")
+        {
+            DataStats stats = BrokerProtocol::statsFromJson(bdmsDataID, request.at("stats"));
+            return fetch(sessionID, bdmsDataID, stats, replyFd, clientFd);
+        }
+        return {{"error", "Unknown broker operation " + op}};
+    }
+    catch (const std::exception &e)
+    {
+        if (replyFd >= 0)
+        {
+            close(replyFd);
+            replyFd = -1;
+        }
+        return {{"error", e.what()}};
+    }
+}
+
+// Fetch into an unlinked shared memory segment, whose descriptor is the reply
+json BrokerDataManager::fetch(const SessionID &sessionID, const BDMSDataID &bdmsDataID, const DataStats &stats, int &replyFd, int clientFd)
+{
+    size_t byteSize = stats.getTotalByteSize();
+    if (DataStats::getTypeByteSize(stats.getBDMSDataType()) == 0)
+        throw std::runtime_error("Unsupported data type " + stats.getBDMSDataType());
+    if (byteSize == 0)
+        return {{"byteSize", 0}};
+
+    std::string name = "/bdms2-broker-" + std::to_string(getpid()) + "-" + std::to_string(_nextSegment++);
+    replyFd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (replyFd < 0)
+        throw std::runtime_error("Cannot create shared memory for " + std::to_string(byteSize) + " bytes");
+    shm_unlink(name.c_str());
+
+    // allocated up front, writing to unallocated pages of a full /dev/shm
+    // would kill the broker with SIGBUS
+    if (!reserveSharedMemory(replyFd, byteSize))
+        throw std::runtime_error("Cannot allocate " + std::to_string(byteSize) + " bytes of shared memory");
+    void *mapped = mmap(nullptr, byteSize, PROT_READ | PROT_WRITE, MAP_SHARED, replyFd, 0);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("Cannot map shared memory of " + std::to_string(byteSize) + " bytes");
+
+    try
+    {
+        auto cancellation = newCancellationToken();
+        auto futures = getDataArraysIntoAsync(sessionID, {bdmsDataID}, {stats}, {static_cast<char *>(mapped)}, cancellation);
+        waitForClient(futures, clientFd, *cancellation);
+        waitForAll(futures);
+    }
+    catch (...)
+    {
+        munmap(mapped, byteSize);
+        throw;
+    }
+    munmap(mapped, byteSize);
+    return {{"byteSize", byteSize}};
+}
+
+// Wait until every future is ready, sending heartbeats to the client. The
+// request is cancelled once the client hangs up.
+template <typename T>
+void BrokerDataManager::waitForClient(std::vector<std::future<T>> &futures, int clientFd, CancellationToken &cancellation)
+{
+    const auto interval = std::chrono::seconds(BrokerProtocol::HEARTBEAT_SECONDS);
+    auto nextHeartbeat = std::chrono::steady_clock::now() + interval;
+    for (auto &future : futures)
+    {
+        while (future.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+        {
+            if (cancellation.isCancelled())
+                continue;
+            if (BrokerProtocol::isHungUp(clientFd))
+            {
+                cancellation.cancel();
+            }
+            else if (std::chrono::steady_clock::now() >= nextHeartbeat)
+            {
+                if (!BrokerProtocol::send(clientFd, {{"heartbeat", true}}))
+                    cancellation.cancel();
+                nextHeartbeat = std::chrono::steady_clock::now() + interval;
+            }
+        }
+    }
+}
+
+// One thread per client connection; the fetch pool does the actual work.
+// Anything going wrong closes only this connection: an exception escaping a
+// detached thread would terminate the broker.
+void serveClient(BrokerDataManager &manager, int clientFd)
+{
+    try
+    {
+        json request;
+        while (BrokerProtocol::receive(clientFd, request))
+        {
+            int replyFd;
+            json reply = manager.handle(request, replyFd, clientFd);
+            bool sent = BrokerProtocol::send(clientFd, reply, replyFd);
+            if (replyFd >= 0)
+                close(replyFd);
+            if (!sent)
+                break;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Closing client connection: " << e.what() << std::endl;
+    }
+    catch (...)
+    {
+        std::cerr << "Closing client connection after an unknown error" << std::endl;
+    }
+    close(clientFd);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string socketPath = argc > 1 ? argv[1] : BDMSConfig::getBrokerSocketPath();
+
+    // the broker's own manager talks to BDMS directly
+    unsetenv("BDMS2_BROKER");
+    unsetenv("BDMS_BROKER");
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return 1;
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // a socket file left by a broker that was killed
+    unlink(socketPath.c_str());
+    // only the user's own processes may connect
+    mode_t previousMask = umask(0177);
+    bool bound = listenFd >= 0 && bind(listenFd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0;
+    umask(previousMask);
+    if (!bound || listen(listenFd, 64) != 0)
+    {
+        std::cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    BrokerDataManager manager;
+    std::cerr << "bdms_broker listening on " << socketPath << std::endl;
+
+    for (;;)
+    {
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            std::cerr << "accept failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        std::thread(serveClient, std::ref(manager), clientFd).detach();
+    }
+}
@@ -0,0 +1,290 @@
+// Cache warmer: fetches every array listed in a manifest into the download
+// cache of this host (see DiskCache), so that MATLAB sessions started later
+// read them from disk instead of downloading them. Runs without MATLAB, e.g.
+// overnight on analysis nodes.
+//
+// Usage: bdms_cache_warm <manifest> [journal]
+//
+// The manifest lists one "<session ID> <data ID>" pair per line, separated by
+// white space. Empty lines and lines starting with # are skipped. Every array
+// whose download is in the cache is appended to the journal (<manifest>.done
+// unless given), and a later run skips the arrays in it, so an interrupted run
+// resumes where it stopped. Ctrl-C cancels the fetches in progress, which the
+// next run repeats. Progress and throughput are reported every few seconds.
+//
+// The usual BDMS2_* environment variables configure the tool. Set
+// BDMS2_CACHE_MAX_BYTES large enough for the manifest, and BDMS2_PERSIST_STATS=1
+// to also keep the HEAD metadata of the arrays. BDMS2_WARM_BUFFER_BYTES bounds
+// the memory of the arrays in flight (1 GiB by default). The other caches and
+// the fetch broker are not used, every array is downloaded into the disk cache.
+//
+// Build with one command line:
+//   g++ -std=c++11 -O2 -pthread -I. -Ibdms2-cpp-library/include
+//       -Ibdms2-cpp-library/include/nlohmann bdms_cache_warm.cpp
+//       -o bdms_cache_warm -lssl -lcrypto -lz -ldl -lrt
+// using the libraries in lib/<platform>; drop -lrt on macOS.
+
+#include "bdms_common.hpp"
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+volatile std::sig_atomic_t interrupted = 0;
+
+void onInterrupt(int)
+{
+    interrupted = 1;
+}
+
+struct ManifestEntry
+{
+    SessionID sessionID;
+    BDMSDataID bdmsDataID;
+};
+
+// Read "<session ID> <data ID>" pairs; returns false if the file cannot be read
+bool readPairs(const std::string &path, std::vector<ManifestEntry> &entries)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        ManifestEntry entry;
+        if (!(fields >> entry.sessionID >> entry.bdmsDataID) || entry.sessionID[0] == '#')
+            continue;
+        entries.push_back(entry);
+    }
+    return true;
+}
+} // namespace
+
+class WarmingDataManager : public BaseBDMSDataManager
+{
+public:
+    using BaseBDMSDataManager::BaseBDMSDataManager; // Inherit constructors
+
+    bool warm(const std::vector<ManifestEntry> &entries, std::ofstream &journal);
+
+protected:
+    bool interruptRequested() override { return interrupted != 0; }
+
+private:
+    struct Pending
+    {
+        ManifestEntry entry;
+        std::string zipHash;
+        std::vector<char> buffer;
+        std::future<void> done;
+    };
+
+    void finish(Pending &pending, std::ofstream &journal);
+    void report(bool force);
+
+    std::shared_ptr<CancellationToken> _cancellation;
+    size_t _total = 0;
+    size_t _warmed = 0;
+    size_t _skipped = 0;
+    size_t _failed = 0;
+    uint64_t _bytes = 0;
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::steady_clock::time_point _lastReport;
+};
+
+/* Fetch all entries, at most 256 of one session per batch of HEAD requests.
+The arrays are fetched into temporary buffers, which are released as soon as
+the download is cached. Returns true if every entry was cached. */
+bool WarmingDataManager::warm(const std::vector<ManifestEntry> &entries, std::ofstream &journal)
+{
+    if (!getDiskCache().isEnabled())
+        throw std::runtime_error("The disk cache is disabled (BDMS2_CACHE_MAX_BYTES=0), there is nothing to warm");
+    // the arrays are only read back from disk, and a download served by
+    // another cache would not be written to it
+    configure("memoryCacheBytes", 0);
+    configure("compressedCacheBytes", 0);
+    configure("decodedCacheBytes", 0);
+    _cancellation = newCancellationToken();
+    _total = entries.size();
+    _start = _lastReport = std::chrono::steady_clock::now();
+
+    uint64_t maxBufferBytes = BDMSConfig::getTuningValue("WARM_BUFFER_BYTES", 1ULL << 30);
+    std::deque<Pending> pending;
+    uint64_t pendingBytes = 0;
+
+    size_t begin = 0;
+    while (begin < entries.size() && !interrupted)
+    {
+        // consecutive entries of one session
+        const SessionID &sessionID = entries[begin].sessionID;
+        size_t end = begin;
+        std::vector<BDMSDataID> ids;
+        while (end < entries.size() && entries[end].sessionID == sessionID && ids.size() < 256)
+            ids.push_back(entries[end++].bdmsDataID);
+
+        auto statsFutures = getAllStatsAsync(sessionID, ids, _cancellation);
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            const ManifestEntry &entry = entries[begin + i];
+            try
+            {
+                DataStats stats = statsFutures[i].get();
+
+                // generated locally or without a key to cache the download under
+                if (isGeneratedLocally(entry.bdmsDataID) || !DiskCache::isValidKey(stats.zip_hash))
+                {
+                    journal << sessionID << ' ' << entry.bdmsDataID << '\n';
+                    ++_skipped;
+                    continue;
+                }
+
+                pending.push_back(Pending{entry, stats.zip_hash, std::vector<char>(stats.getTotalByteSize()), std::future<void>()});
+                Pending &added = pending.back();
+                added.done = std::move(getDataArraysIntoAsync(sessionID, {entry.bdmsDataID}, {stats}, {added.buffer.data()}, _cancellation)[0]);
+                pendingBytes += added.buffer.size();
+            }
+            catch (const std::exception &e)
+            {
+                if (!_cancellation->isCancelled())
+                {
+                    std::cerr << "Failed " << sessionID << " " << entry.bdmsDataID << ": " << e.what() << std::endl;
+                    ++_failed;
+                }
+                continue;
+            }
+
+            // keep enough fetches queued to use every connection
+            while (pendingBytes > maxBufferBytes || pending.size() > 1024)
+            {
+                pendingBytes -= pending.front().buffer.size();
+                finish(pending.front(), journal);
+                pending.pop_front();
+            }
+        }
+        begin = end;
+        journal.flush();
+        report(false);
+    }
+
+    while (!pending.empty())
+    {
+        finish(pending.front(), journal);
+        pending.pop_front();
+    }
+    journal.flush();
+    report(true);
+    return _failed == 0 && !interrupted;
+}
+
+// Wait for one fetch, and journal it once its download is in the disk cache
+void WarmingDataManager::finish(Pending &pending, std::ofstream &journal)
+{
+    while (pending.done.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+    {
+        if (interrupted)
+            _cancellation->cancel();
+        report(false);
+    }
+
+    try
+    {
+        pending.done.get();
+        // e.g. the cache could not write the file, or evicted it already
+        if (!std::ifstream(getDiskCache().pathOf(pending.zipHash)))
+            throw std::runtime_error("The download was not stored in the disk cache");
+        journal << pending.entry.sessionID << ' ' << pending.entry.bdmsDataID << '\n';
+        ++_warmed;
+        _bytes += pending.buffer.size();
+    }
+    catch (const FetchCancelledError &)
+    {
+        // not journaled, the next run fetches it again
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Failed " << pending.entry.sessionID << " " << pending.entry.bdmsDataID << ": " << e.what() << std::endl;
+        ++_failed;
+    }
+}
+
+// Progress line, at most every 5 seconds unless forced
+void WarmingDataManager::report(bool force)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - _lastReport < std::chrono::seconds(5))
+        return;
+    _lastReport = now;
+
+    double seconds = std::chrono::duration<double>(now - _start).count();
+    double megabytes = _bytes / 1e6;
+    char line[256];
+    std::snprintf(line, sizeof(line), "%zu of %zu arrays cached, %zu skipped, %zu failed, %.1f MB in %.0f s (%.1f MB/s)",
+                  _warmed, _total, _skipped, _failed, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+    std::cerr << line << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <manifest> [journal]" << std::endl;
+        return 2;
+    }
+    std::string manifestPath = argv[1];
+    std::string journalPath = argc > 2 ? argv[2] : manifestPath + ".done";
+
+    std::vector<ManifestEntry> manifest;
+    if (!readPairs(manifestPath, manifest))
+    {
+        std::cerr << "Cannot read manifest " << manifestPath << std::endl;
+        return 2;
+    }
+
+    // skip what an earlier run cached, and duplicates
+    std::vector<ManifestEntry> done;
+    readPairs(journalPath, done);
+    std::set<std::string> seen;
+    for (const ManifestEntry &entry : done)
+        seen.insert(entry.sessionID + "/" + entry.bdmsDataID);
+    std::vector<ManifestEntry> remaining;
+    for (const ManifestEntry &entry : manifest)
+    {
+        if (seen.insert(entry.sessionID + "/" + entry.bdmsDataID).second)
+            remaining.push_back(entry);
+    }
+    std::cerr << manifest.size() - remaining.size() << " of " << manifest.size()
+              << " arrays are cached already or listed twice" << std::endl;
+
+    std::ofstream journal(journalPath, std::ios::app);
+    if (!journal)
+    {
+        std::cerr << "Cannot write journal " << journalPath << std::endl;
+        return 2;
+    }
+
+    // the broker and the shared memory cache would serve arrays without
+    // writing them to the disk cache
+    unsetenv("BDMS2_BROKER");
+    unsetenv("BDMS_BROKER");
+    unsetenv("BDMS2_SHARED_CACHE_BYTES");
+    unsetenv("BDMS_SHARED_CACHE_BYTES");
+
+    std::signal(SIGINT, onInterrupt);
+    try
+    {
+        WarmingDataManager manager;
+        if (manager.warm(remaining, journal))
+            return 0;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    return 1;
+}
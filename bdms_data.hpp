@@ -1,39 +1,148 @@
 #include "bdms_common.hpp"
 
+// Undocumented MATLAB API (libut): true once the user pressed Ctrl-C
+extern "C" bool utIsInterruptPending(void);
+
 class BDMSDataManager : public BaseBDMSDataManager
 {
 public:
     using BaseBDMSDataManager::BaseBDMSDataManager; // Inherit constructors
+    ~BDMSDataManager();
 
     mxArray *getArray(const SessionID &sessionID, std::vector<std::string> &dataIDs);
     mxArray *getArraysBySessionId(const std::map<SessionID, std::vector<BDMSDataID>> &dataToDownload);
+    // Metadata of the arrays without their values, see getStatsBySessionId
+    mxArray *getStatsBySessionId(const std::map<SessionID, std::vector<BDMSDataID>> &dataToDescribe);
+
+    // Background fetches: startFetch returns a ticket right away, collect
+    // returns the same cell array as getArraysBySessionId
+    uint64_t startFetch(const std::map<SessionID, std::vector<BDMSDataID>> &dataToDownload);
+    mxArray *poll(uint64_t ticket);
+    bool wait(uint64_t ticket, double timeoutSeconds);
+    mxArray *collect(uint64_t ticket);
+    void cancel(uint64_t ticket);
+
+    // Values first to first + count of an identifier that is generated
+    // locally, as bytes like getArray returns them
+    mxArray *expandGenerated(const BDMSDataID &bdmsDataID, size_t first, size_t count);
+    // whether expandGenerated accepts an identifier
+    using BaseBDMSDataManager::isGeneratedLocally;
+
+protected:
+    bool interruptRequested() override { return utIsInterruptPending(); }
+
+private:
+    struct SessionFetch
+    {
+        SessionID sessionID;
+        std::vector<BDMSDataID> ids;
+        // one per identifier that is not described
+        std::vector<std::future<GenericVector>> dataFutures;
+    };
+
+    struct FetchTicket
+    {
+        std::mutex mutex;
+        size_t total = 0;
+        // arrays returned as descriptors, which are done right away
+        size_t described = 0;
+        bool describeGenerated = false;
+        // filled in by the submitter as the fetch tasks are queued
+        std::vector<SessionFetch> sessions;
+        std::shared_ptr<CancellationToken> cancellation;
+        // declared last: destroying it waits for the submitter, which uses
+        // the members above
+        std::future<void> submitter;
+    };
+
+    std::shared_ptr<FetchTicket> findTicket(uint64_t ticket);
+    bool waitForFetch(FetchTicket &fetch, std::chrono::steady_clock::time_point deadline);
+    mxArray *describeGenerated(const BDMSDataID &bdmsDataID);
+    static mxArray *createValue(const std::string &bdmsDataType, bool empty);
+    static mxArray *createValueFromHex(const std::string &bdmsDataType, const std::string &littleEndianHex);
+    static mxClassID classOf(const std::string &bdmsDataType);
+    template <typename T>
+    bool waitUntil(const std::future<T> &future, std::chrono::steady_clock::time_point deadline);
+
+    std::mutex _ticketsMutex;
+    std::map<uint64_t, std::shared_ptr<FetchTicket>> _tickets;
+    uint64_t _nextTicket = 1;
 };
 
+BDMSDataManager::~BDMSDataManager()
+{
+    std::map<uint64_t, std::shared_ptr<FetchTicket>> tickets;
+    {
+        std::lock_guard<std::mutex> lock(_ticketsMutex);
+        tickets.swap(_tickets);
+    }
+
+    // stop the background fetches, then wait for their submitters, which
+    // call into this manager
+    for (auto &entry : tickets)
+        entry.second->cancellation->cancel();
+    for (auto &entry : tickets)
+        entry.second->submitter.wait();
+}
+
 mxArray *BDMSDataManager::getArray(const SessionID &sessionID, std::vector<std::string> &dataIDs)
 {
-    auto dataFutures = getDataArraysAsync(sessionID, dataIDs);
-    std::vector<GenericVector> chunks(dataFutures.size());
+    // Ctrl-C cancels the fetches of this call
+    auto cancellation = newCancellationToken();
+
+    // Size the output up front so every chunk is written straight into it
+    std::vector<DataStats> stats;
+    try
+    {
+        stats = getAllStats(sessionID, dataIDs, cancellation);
+    }
+    catch (const FetchCancelledError &)
+    {
+        // reported below, outside of the catch block
+    }
+    if (cancellation->isCancelled())
+        mexErrMsgIdAndTxt("bdms:interrupted", "getArray: Interrupted by the user.");
 
     size_t totalByteSize = 0;
-    for (size_t i = 0; i < dataFutures.size(); ++i)
+    std::vector<size_t> byteOffsets(stats.size());
+    for (size_t i = 0; i < stats.size(); ++i)
     {
-        chunks[i] = dataFutures[i].get();
-        totalByteSize += chunks[i].byteSize();
+        byteOffsets[i] = totalByteSize;
+        totalByteSize += stats[i].getTotalByteSize();
     }
 
-    // Create MATLAB uint8 column vector with the expected size
-    mwSize dims[2] = {totalByteSize, 1};
-    mxArray *outputBytes = mxCreateNumericArray(2, dims, mxUINT8_CLASS, mxREAL);
+    // Create MATLAB uint8 column vector with the expected size. Every byte is
+    // overwritten below, so skip the zero-initialization.
+    mxArray *outputBytes = mxCreateUninitNumericMatrix(totalByteSize, 1, mxUINT8_CLASS, mxREAL);
     char *outputBuffer = static_cast<char *>(mxGetData(outputBytes));
 
-    size_t byteOffset = 0;
-    for (size_t i = 0; i < chunks.size(); ++i)
+    std::vector<char *> buffers(stats.size());
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        buffers[i] = outputBuffer + byteOffsets[i];
+    }
+
+    auto dataFutures = getDataArraysIntoAsync(sessionID, dataIDs, stats, buffers, cancellation);
+    try
+    {
+        waitForAll(dataFutures, cancellation.get());
+    }
+    catch (const FetchCancelledError &)
+    {
+        // reported below, outside of the catch block
+    }
+    catch (...)
     {
-        size_t chunkByteSize = chunks[i].byteSize();
-        std::memcpy(outputBuffer + byteOffset, chunks[i].buffer(), chunkByteSize);
-        byteOffset += chunkByteSize;
+        mxDestroyArray(outputBytes);
+        throw;
     }
 
+    if (cancellation->isCancelled())
+    {
+        mxDestroyArray(outputBytes);
+        mexErrMsgIdAndTxt("bdms:interrupted", "getArray: Interrupted by the user.");
+    }
+    prefetchRelated(sessionID, dataIDs);
     return outputBytes;
 }
 
@@ -41,44 +150,461 @@ mxArray *BDMSDataManager::getArraysBySessionId(const std::map<SessionID, std::ve
 {
     mxArray *output = mxCreateCellMatrix(dataToDownload.size(), 1);
 
-    // Create a vector to store futures for all sessions
-    std::vector<std::pair<SessionID, std::vector<std::future<GenericVector>>>> allFutures;
-    allFutures.reserve(dataToDownload.size());
+    // Allocate every output array on the MATLAB thread first, then let the
+    // fetch tasks of all sessions fill them in place. The jobs of all sessions
+    // are submitted together, so the largest downloads start first.
+    auto cancellation = newCancellationToken();
+    bool describe = describesGenerated();
+    std::vector<FetchJob> jobs;
+    std::vector<std::future<void>> allFutures;
+    bool interrupted = false;
+    try
+    {
+        // the HEAD requests of all sessions run concurrently
+        std::vector<std::vector<std::future<DataStats>>> statsFutures;
+        for (const auto &entry : dataToDownload)
+            statsFutures.push_back(getAllStatsAsync(entry.first, entry.second, cancellation));
+
+        size_t i = 0;
+        for (const auto &entry : dataToDownload)
+        {
+            const SessionID &sessionID = entry.first;
+            const std::vector<BDMSDataID> &dataIDs = entry.second;
+            std::vector<DataStats> stats = collectStats(sessionID, dataIDs, statsFutures[i], cancellation.get());
 
-    // Trigger getDataArraysAsync for all sessions
+            // set session ID in output structure
+            mxArray *outputForSessionID = mxCreateCellMatrix(dataIDs.size() + 1, 1);
+            mxSetCell(outputForSessionID, 0, mxCreateString(sessionID.c_str()));
+            mxSetCell(output, i++, outputForSessionID);
+
+            for (size_t j = 0; j < stats.size(); ++j)
+            {
+                // on request, a descriptor instead of the values
+                if (describe && isGeneratedLocally(dataIDs[j]))
+                {
+                    mxSetCell(outputForSessionID, j + 1, describeGenerated(dataIDs[j]));
+                    continue;
+                }
+                mxArray *outputBytes = mxCreateUninitNumericMatrix(stats[j].getTotalByteSize(), 1, mxUINT8_CLASS, mxREAL);
+                jobs.push_back(FetchJob{sessionID, dataIDs[j], stats[j], static_cast<char *>(mxGetData(outputBytes))});
+                mxSetCell(outputForSessionID, j + 1, outputBytes);
+            }
+        }
+
+        allFutures = submitFetchJobs(jobs, cancellation);
+        waitForAll(allFutures, cancellation.get());
+    }
+    catch (...)
+    {
+        // no task may still be writing into the arrays we are about to free
+        for (auto &future : allFutures)
+        {
+            if (future.valid())
+                future.wait();
+        }
+        mxDestroyArray(output);
+        if (!cancellation->isCancelled())
+            throw;
+        interrupted = true;
+    }
+
+    // raised outside of the catch block, mexErrMsgTxt does not return
+    if (interrupted)
+        mexErrMsgIdAndTxt("bdms:interrupted", "getArraysBySessionId: Interrupted by the user.");
     for (const auto &entry : dataToDownload)
+        prefetchRelated(entry.first, entry.second);
+    return output;
+}
+
+/* A struct array with one element per identifier, in the order of the sessions
+and their identifiers, with the fields sessionID, dataID, type, dimensions,
+count, totalCount, min, max and error. min and max have the class of the
+values and are empty when unknown. Identifiers that describe themselves need no
+request, the others one HEAD request each, which run concurrently. An
+identifier whose HEAD request failed has only the error field set. */
+mxArray *BDMSDataManager::getStatsBySessionId(const std::map<SessionID, std::vector<BDMSDataID>> &dataToDescribe)
+{
+    auto cancellation = newCancellationToken();
+    std::vector<std::vector<std::future<DataStats>>> statsFutures;
+    size_t total = 0;
+    for (const auto &entry : dataToDescribe)
     {
-        const SessionID &sessionID = entry.first;
-        const std::vector<BDMSDataID> &dataIDs = entry.second;
-        allFutures.emplace_back(sessionID, getDataArraysAsync(sessionID, dataIDs));
+        statsFutures.push_back(getAllStatsAsync(entry.first, entry.second, cancellation));
+        total += entry.second.size();
     }
 
-    // Process the futures
-    for (size_t i = 0; i < allFutures.size(); ++i)
+    const char *fieldNames[] = {"sessionID", "dataID", "type", "dimensions", "count", "totalCount", "min", "max", "error"};
+    mxArray *output = mxCreateStructMatrix(total, 1, 9, fieldNames);
+    size_t i = 0;
+    size_t session = 0;
+    bool interrupted = false;
+    for (const auto &entry : dataToDescribe)
     {
-        const SessionID &sessionID = allFutures[i].first;
-        std::vector<std::future<GenericVector>> &dataFutures = allFutures[i].second;
+        for (size_t j = 0; j < entry.second.size() && !interrupted; ++j, ++i)
+        {
+            mxSetField(output, i, "sessionID", mxCreateString(entry.first.c_str()));
+            mxSetField(output, i, "dataID", mxCreateString(entry.second[j].c_str()));
+
+            std::future<DataStats> &future = statsFutures[session][j];
+            if (!waitUntil(future, std::chrono::steady_clock::time_point::max()))
+            {
+                cancellation->cancel();
+                interrupted = true;
+                break;
+            }
+            try
+            {
+                DataStats stats = future.get();
+                std::string type = stats.getBDMSDataType();
+                std::vector<size_t> dimensions = stats.getDimensionality();
+                mxArray *dimensionValues = mxCreateNumericMatrix(1, dimensions.size(), mxDOUBLE_CLASS, mxREAL);
+                double *dimensionData = static_cast<double *>(mxGetData(dimensionValues));
+                for (size_t k = 0; k < dimensions.size(); ++k)
+                    dimensionData[k] = (double)dimensions[k];
+
+                mxSetField(output, i, "type", mxCreateString(type.c_str()));
+                mxSetField(output, i, "dimensions", dimensionValues);
+                mxSetField(output, i, "count", mxCreateDoubleScalar((double)stats.getDataCount()));
+                mxSetField(output, i, "totalCount", mxCreateDoubleScalar((double)stats.getTotalValueCount()));
+                mxSetField(output, i, "min", createValueFromHex(type, stats.min_value_hex));
+                mxSetField(output, i, "max", createValueFromHex(type, stats.max_value_hex));
+            }
+            catch (const FetchCancelledError &)
+            {
+                interrupted = true;
+            }
+            catch (const std::exception &e)
+            {
+                mxSetField(output, i, "error", mxCreateString(e.what()));
+            }
+        }
+        ++session;
+    }
+
+    // raised outside of the catch block, mexErrMsgTxt does not return
+    if (interrupted)
+    {
+        mxDestroyArray(output);
+        mexErrMsgIdAndTxt("bdms:interrupted", "getStats: Interrupted by the user.");
+    }
+    return output;
+}
 
-        // set session ID in output structure
-        mxArray *outputForSessionID = mxCreateCellMatrix(dataFutures.size() + 1, 1);
-        mxSetCell(outputForSessionID, 0, mxCreateString(sessionID.c_str()));
+uint64_t BDMSDataManager::startFetch(const std::map<SessionID, std::vector<BDMSDataID>> &dataToDownload)
+{
+    auto fetch = std::make_shared<FetchTicket>();
+    fetch->cancellation = newCancellationToken();
+    fetch->describeGenerated = describesGenerated();
+    for (const auto &entry : dataToDownload)
+        fetch->total += entry.second.size();
 
-        for (size_t j = 0; j < dataFutures.size(); ++j)
+    // Queueing can block while the fetch pool's queue is full, so it happens
+    // on a thread of its own and the caller gets the ticket right away. The
+    // submitter holds a plain pointer: the ticket owns it and waits for it
+    // when destroyed, so a shared_ptr would keep the ticket alive forever.
+    FetchTicket *pending = fetch.get();
+    fetch->submitter = std::async(std::launch::async, [this, pending, dataToDownload]()
+    {
+        for (const auto &entry : dataToDownload)
         {
-            GenericVector chunk = dataFutures[j].get();
-            size_t chunkByteSize = chunk.byteSize();
+            if (pending->cancellation->isCancelled())
+                break;
+            SessionFetch session{entry.first, entry.second, {}};
+            std::vector<BDMSDataID> fetchedIDs;
+            for (const BDMSDataID &bdmsDataID : entry.second)
+            {
+                if (!pending->describeGenerated || !isGeneratedLocally(bdmsDataID))
+                    fetchedIDs.push_back(bdmsDataID);
+            }
+            session.dataFutures = getDataArraysAsync(entry.first, fetchedIDs, pending->cancellation);
+            {
+                std::lock_guard<std::mutex> lock(pending->mutex);
+                pending->described += entry.second.size() - fetchedIDs.size();
+                pending->sessions.push_back(std::move(session));
+            }
+            // queued behind the fetch itself, as low priority tasks
+            prefetchRelated(entry.first, entry.second);
+        }
+    });
+
+    std::lock_guard<std::mutex> lock(_ticketsMutex);
+    uint64_t ticket = _nextTicket++;
+    _tickets[ticket] = fetch;
+    return ticket;
+}
+
+std::shared_ptr<BDMSDataManager::FetchTicket> BDMSDataManager::findTicket(uint64_t ticket)
+{
+    std::shared_ptr<FetchTicket> fetch;
+    {
+        std::lock_guard<std::mutex> lock(_ticketsMutex);
+        auto found = _tickets.find(ticket);
+        if (found != _tickets.end())
+            fetch = found->second;
+    }
 
-            mwSize dims[2] = {chunkByteSize, 1};
-            mxArray *outputBytes = mxCreateNumericArray(2, dims, mxUINT8_CLASS, mxREAL);
-            char *outputBuffer = static_cast<char *>(mxGetData(outputBytes));
+    // raise outside of the lock, mexErrMsgTxt does not return
+    if (!fetch)
+        mexErrMsgTxt("Unknown fetch ticket, it may have been collected already.");
+    return fetch;
+}
 
-            std::memcpy(outputBuffer, chunk.buffer(), chunkByteSize);
+// Progress of a background fetch as a struct with fields completed, total and done
+mxArray *BDMSDataManager::poll(uint64_t ticket)
+{
+    auto fetch = findTicket(ticket);
 
-            mxSetCell(outputForSessionID, j + 1, outputBytes);
+    size_t completed = 0;
+    {
+        std::lock_guard<std::mutex> lock(fetch->mutex);
+        completed = fetch->described;
+        for (auto &session : fetch->sessions)
+        {
+            for (auto &future : session.dataFutures)
+            {
+                if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                    ++completed;
+            }
         }
+    }
+
+    const char *fieldNames[] = {"completed", "total", "done"};
+    mxArray *progress = mxCreateStructMatrix(1, 1, 3, fieldNames);
+    mxSetField(progress, 0, "completed", mxCreateDoubleScalar((double)completed));
+    mxSetField(progress, 0, "total", mxCreateDoubleScalar((double)fetch->total));
+    mxSetField(progress, 0, "done", mxCreateLogicalScalar(completed == fetch->total));
+    return progress;
+}
 
-        mxSetCell(output, i, outputForSessionID);
+// Wait up to timeoutSeconds (Inf waits indefinitely) and return whether the
+// fetch has completed
+bool BDMSDataManager::wait(uint64_t ticket, double timeoutSeconds)
+{
+    auto fetch = findTicket(ticket);
+
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    if (timeoutSeconds < 1e9)
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                       std::chrono::duration<double>(std::max(timeoutSeconds, 0.0)));
+
+    return waitForFetch(*fetch, deadline);
+}
+
+bool BDMSDataManager::waitForFetch(FetchTicket &fetch, std::chrono::steady_clock::time_point deadline)
+{
+    if (!waitUntil(fetch.submitter, deadline))
+        return false;
+
+    // the submitter is done, so the sessions no longer change
+    for (auto &session : fetch.sessions)
+    {
+        for (auto &future : session.dataFutures)
+        {
+            if (!waitUntil(future, deadline))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Wait in short slices, so that Ctrl-C ends the wait (but not the fetch)
+template <typename T>
+bool BDMSDataManager::waitUntil(const std::future<T> &future, std::chrono::steady_clock::time_point deadline)
+{
+    for (;;)
+    {
+        auto slice = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+        if (future.wait_until(slice) == std::future_status::ready)
+            return true;
+        if (slice == deadline || interruptRequested())
+            return false;
+    }
+}
+
+
+// Wait for a background fetch to complete and return its data. The ticket is
+// released, also when the fetch failed. Ctrl-C ends the wait but keeps the
+// ticket, so the fetch can still be collected or cancelled.
+mxArray *BDMSDataManager::collect(uint64_t ticket)
+{
+    auto fetch = findTicket(ticket);
+    if (!waitForFetch(*fetch, std::chrono::steady_clock::time_point::max()))
+    {
+        fetch.reset();
+        mexErrMsgIdAndTxt("bdms:interrupted", "collect: Interrupted by the user.");
+    }
+    {
+        std::lock_guard<std::mutex> lock(_ticketsMutex);
+        _tickets.erase(ticket);
+    }
+
+    fetch->submitter.get();
+
+    mxArray *output = mxCreateCellMatrix(fetch->sessions.size(), 1);
+    try
+    {
+        for (size_t i = 0; i < fetch->sessions.size(); ++i)
+        {
+            SessionFetch &session = fetch->sessions[i];
+
+            mxArray *outputForSessionID = mxCreateCellMatrix(session.ids.size() + 1, 1);
+            mxSetCell(outputForSessionID, 0, mxCreateString(session.sessionID.c_str()));
+            mxSetCell(output, i, outputForSessionID);
+
+            size_t next = 0;
+            for (size_t j = 0; j < session.ids.size(); ++j)
+            {
+                if (fetch->describeGenerated && isGeneratedLocally(session.ids[j]))
+                {
+                    mxSetCell(outputForSessionID, j + 1, describeGenerated(session.ids[j]));
+                    continue;
+                }
+                GenericVector chunk = session.dataFutures[next++].get();
+                size_t chunkByteSize = chunk.byteSize();
+
+                mxArray *outputBytes = mxCreateUninitNumericMatrix(chunkByteSize, 1, mxUINT8_CLASS, mxREAL);
+                std::memcpy(mxGetData(outputBytes), chunk.buffer(), chunkByteSize);
+                mxSetCell(outputForSessionID, j + 1, outputBytes);
+            }
+        }
+    }
+    catch (...)
+    {
+        mxDestroyArray(output);
+        throw;
     }
 
     return output;
 }
+
+// Stop a background fetch and release its ticket. Downloads in progress are
+// aborted, queued ones never start.
+void BDMSDataManager::cancel(uint64_t ticket)
+{
+    auto fetch = findTicket(ticket);
+    fetch->cancellation->cancel();
+
+    std::lock_guard<std::mutex> lock(_ticketsMutex);
+    _tickets.erase(ticket);
+}
+
+mxArray *BDMSDataManager::expandGenerated(const BDMSDataID &bdmsDataID, size_t first, size_t count)
+{
+    DataStats stats = DataStats::fromIdentifier(bdmsDataID);
+    size_t typeSize = DataStats::getTypeByteSize(stats.getBDMSDataType());
+
+    mxArray *outputBytes = mxCreateUninitNumericMatrix(count * typeSize, 1, mxUINT8_CLASS, mxREAL);
+    try
+    {
+        generateValues(bdmsDataID, first, count, static_cast<char *>(mxGetData(outputBytes)));
+    }
+    catch (...)
+    {
+        mxDestroyArray(outputBytes);
+        throw;
+    }
+    return outputBytes;
+}
+
+// A struct with fields kind ('constant' or 'range'), type, dimensions, count,
+// first, last and step in place of the values of a generated array. first and
+// last have the class of the values, and are empty for an empty array.
+mxArray *BDMSDataManager::describeGenerated(const BDMSDataID &bdmsDataID)
+{
+    DataStats stats = DataStats::fromIdentifier(bdmsDataID);
+    std::vector<std::string> identifierParts = DataStats::getIdentifierParts(bdmsDataID);
+    std::string type = stats.getBDMSDataType();
+    size_t count = stats.getTotalValueCount();
+    bool constant = getGeneratedKind(bdmsDataID) == "constant";
+
+    const char *fieldNames[] = {"kind", "type", "dimensions", "count", "first", "last", "step"};
+    mxArray *descriptor = mxCreateStructMatrix(1, 1, 7, fieldNames);
+    mxSetField(descriptor, 0, "kind", mxCreateString(constant ? "constant" : "range"));
+    mxSetField(descriptor, 0, "type", mxCreateString(type.c_str()));
+
+    std::vector<size_t> dimensions = stats.getDimensionality();
+    mxArray *dimensionValues = mxCreateNumericMatrix(1, dimensions.size(), mxDOUBLE_CLASS, mxREAL);
+    double *dimensionData = static_cast<double *>(mxGetData(dimensionValues));
+    for (size_t i = 0; i < dimensions.size(); ++i)
+        dimensionData[i] = (double)dimensions[i];
+    mxSetField(descriptor, 0, "dimensions", dimensionValues);
+    mxSetField(descriptor, 0, "count", mxCreateDoubleScalar((double)count));
+
+    mxArray *firstValue = createValue(type, count == 0);
+    mxArray *lastValue = createValue(type, count == 0);
+    mxSetField(descriptor, 0, "first", firstValue);
+    mxSetField(descriptor, 0, "last", lastValue);
+    mxSetField(descriptor, 0, "step", mxCreateDoubleScalar(constant ? 0.0 : std::stod(identifierParts[4])));
+    try
+    {
+        if (count > 0)
+        {
+            generateValues(bdmsDataID, 0, 1, static_cast<char *>(mxGetData(firstValue)));
+            generateValues(bdmsDataID, count - 1, 1, static_cast<char *>(mxGetData(lastValue)));
+        }
+    }
+    catch (...)
+    {
+        mxDestroyArray(descriptor);
+        throw;
+    }
+    return descriptor;
+}
+
+// A 1x1 (or empty) array of the MATLAB class of a BDMS data type, uint8 if the
+// type has no class of its own
+mxArray *BDMSDataManager::createValue(const std::string &bdmsDataType, bool empty)
+{
+    size_t n = empty ? 0 : 1;
+    if (bdmsDataType == "bool")
+        return mxCreateLogicalMatrix(n, n);
+    return mxCreateNumericMatrix(n, n, classOf(bdmsDataType), mxREAL);
+}
+
+// The value of a little endian hex string of BDMS statistics, empty if the hex
+// string is missing or too short
+mxArray *BDMSDataManager::createValueFromHex(const std::string &bdmsDataType, const std::string &littleEndianHex)
+{
+    size_t typeSize = DataStats::getTypeByteSize(bdmsDataType);
+    if (typeSize == 0 || littleEndianHex.size() < 2 * typeSize)
+        return createValue(bdmsDataType, true);
+
+    // MATLAB only runs on little endian hosts, so the bytes are in memory order
+    unsigned char bytes[8];
+    for (size_t i = 0; i < typeSize; ++i)
+    {
+        char digits[3] = {littleEndianHex[2 * i], littleEndianHex[2 * i + 1], 0};
+        char *end = nullptr;
+        bytes[i] = (unsigned char)std::strtoul(digits, &end, 16);
+        if (end != digits + 2)
+            return createValue(bdmsDataType, true);
+    }
+
+    mxArray *value = createValue(bdmsDataType, false);
+    std::memcpy(mxGetData(value), bytes, typeSize);
+    return value;
+}
+
+mxClassID BDMSDataManager::classOf(const std::string &bdmsDataType)
+{
+    if (bdmsDataType == "int8")
+        return mxINT8_CLASS;
+    if (bdmsDataType == "uint16")
+        return mxUINT16_CLASS;
+    if (bdmsDataType == "int16")
+        return mxINT16_CLASS;
+    if (bdmsDataType == "uint32")
+        return mxUINT32_CLASS;
+    if (bdmsDataType == "int32")
+        return mxINT32_CLASS;
+    if (bdmsDataType == "uint64")
+        return mxUINT64_CLASS;
+    if (bdmsDataType == "int64")
+        return mxINT64_CLASS;
+    if (bdmsDataType == "float")
+        return mxSINGLE_CLASS;
+    if (bdmsDataType == "double")
+        return mxDOUBLE_CLASS;
+    return mxUINT8_CLASS;
+}
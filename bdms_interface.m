@@ -21,6 +21,66 @@ classdef bdms_interface < handle
             [varargout{1:nargout}] = bdms_mex('getArray', this.objectHandle, varargin{:});
         end
 
+        %% getStats - struct array with the type, dimensions, counts, min and max of each of the {sessionID, dataID1, ...} cells, without downloading the data
+        function stats = getStats(this, sessionIDsAndDataIDs)
+            stats = bdms_mex('getStats', this.objectHandle, sessionIDsAndDataIDs);
+        end
+
+        %% startFetch - start downloading {sessionID, dataID1, ...} cells in the background, returns a ticket
+        function ticket = startFetch(this, sessionIDsAndDataIDs)
+            ticket = bdms_mex('startFetch', this.objectHandle, sessionIDsAndDataIDs);
+        end
+
+        %% poll - progress of a background fetch (fields completed, total, done)
+        function progress = poll(this, ticket)
+            progress = bdms_mex('poll', this.objectHandle, ticket);
+        end
+
+        %% wait - wait for a background fetch, optionally at most timeoutSeconds; returns true when done
+        function done = wait(this, ticket, varargin)
+            done = bdms_mex('wait', this.objectHandle, ticket, varargin{:});
+        end
+
+        %% collect - data of a background fetch, in the same layout as getArraysBySessionId
+        function data = collect(this, ticket)
+            data = bdms_mex('collect', this.objectHandle, ticket);
+        end
+
+        %% prefetch - load {sessionID, dataID1, ...} cells into the memory cache in the background, ahead of a fetch
+        function prefetch(this, sessionIDsAndDataIDs)
+            bdms_mex('prefetch', this.objectHandle, sessionIDsAndDataIDs);
+        end
+
+        %% getCachedArrayPath - decoded cache file of one array and the offset of its values, for memmapfile ('' if disabled)
+        function [path, offset] = getCachedArrayPath(this, sessionID, dataID)
+            [path, offset] = bdms_mex('getCachedArrayPath', this.objectHandle, sessionID, dataID);
+        end
+
+        %% expandGenerated - bytes of a locally generated array (e.g. special:constant), optionally only count values from index first
+        function bytes = expandGenerated(this, dataID, varargin)
+            bytes = bdms_mex('expandGenerated', this.objectHandle, dataID, varargin{:});
+        end
+
+        %% cancel - stop a background fetch and release its ticket
+        function cancel(this, ticket)
+            bdms_mex('cancel', this.objectHandle, ticket);
+        end
+
+        %% configure - change a performance setting, e.g. configure('maxConnections', 16)
+        function configure(this, option, value)
+            bdms_mex('configure', this.objectHandle, option, value);
+        end
+
+        %% getStatistics - struct with the current concurrency limit, connection and cache counters
+        function statistics = getStatistics(this)
+            statistics = bdms_mex('getStatistics', this.objectHandle);
+        end
+
+        %% resetSharedCache - delete the shared memory cache of the user (BDMS2_SHARED_CACHE_BYTES), e.g. after a crash; instances created afterwards start empty
+        function resetSharedCache(this)
+            bdms_mex('resetSharedCache', this.objectHandle);
+        end
+
     end
 
 end
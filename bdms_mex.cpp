@@ -7,6 +7,71 @@
 #include "bdms_data.hpp"
 #include <string.h>
 
+// Convert a cell array of {sessionID, dataID1, dataID2, ...} cell arrays
+std::map<SessionID, std::vector<BDMSDataID>> parseSessionMap(const mxArray *sessionIDsAndDataIDs, const char *command)
+{
+    std::map<SessionID, std::vector<BDMSDataID>> dataToDownload;
+
+    size_t numSessions = mxGetNumberOfElements(sessionIDsAndDataIDs);
+
+    for (size_t i = 0; i < numSessions; i++)
+    {
+        mxArray *sessionIDAndDataIDs = mxGetCell(sessionIDsAndDataIDs, i);
+
+        size_t numDataIDsIncludingSessionID = mxGetNumberOfElements(sessionIDAndDataIDs);
+
+        if (numDataIDsIncludingSessionID < 2)
+            mexErrMsgIdAndTxt("bdms:invalidInput", "%s: Each session must have at least one data ID.", command);
+
+        size_t numDataIDs = numDataIDsIncludingSessionID - 1;
+
+        // get session ID
+        mxArray *sessionID = mxGetCell(sessionIDAndDataIDs, 0);
+        char *sessionIDChars = mxArrayToString(sessionID);
+
+        std::string sessionIDStr = std::string(sessionIDChars);
+        mxFree(sessionIDChars);
+
+        // get data IDs
+        char **dataIDs = (char **)mxCalloc(numDataIDs, sizeof(char *));
+        for (size_t j = 0; j < numDataIDs; j++)
+        {
+            mxArray *dataID = mxGetCell(sessionIDAndDataIDs, j + 1);
+            char *dataIDChars = mxArrayToString(dataID);
+            dataIDs[j] = dataIDChars;
+        }
+        std::vector<std::string> ids(dataIDs, dataIDs + numDataIDs);
+        for (int i = 0; i < numDataIDs; i++)
+        {
+            mxFree(dataIDs[i]);
+        }
+        mxFree(dataIDs);
+
+        // add to request map
+        dataToDownload.emplace(sessionIDStr, ids);
+    }
+
+    return dataToDownload;
+}
+
+// True for a real numeric scalar holding a whole number from min to max
+bool isIntegerScalar(const mxArray *value, double min, double max)
+{
+    if (!mxIsNumeric(value) || mxIsComplex(value) || mxGetNumberOfElements(value) != 1)
+        return false;
+    double scalar = mxGetScalar(value);
+    // false for NaN as well
+    return scalar >= min && scalar <= max && scalar == std::floor(scalar);
+}
+
+// A ticket returned by startFetch
+uint64_t parseTicket(const mxArray *ticket, const char *command)
+{
+    if (!isIntegerScalar(ticket, 1, 9007199254740992.0))
+        mexErrMsgIdAndTxt("bdms:invalidInput", "%s: The ticket must be a positive integer.", command);
+    return (uint64_t)mxGetScalar(ticket);
+}
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     char cmd[64];
@@ -100,48 +165,174 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         if (nlhs != 1 || nrhs != 3)
             mexErrMsgTxt("getArraysBySessionId: Unexpected arguments.");
 
-        std::map<SessionID, std::vector<BDMSDataID>> dataToDownload;
+        plhs[0] = bdms_instance->getArraysBySessionId(parseSessionMap(prhs[2], "getArraysBySessionId"));
+        return;
+    }
+
+    // Type, dimensions, counts, minimum and maximum of each array, without
+    // downloading any values
+    if (!strcmp("getStats", cmd))
+    {
+        if (nlhs != 1 || nrhs != 3)
+            mexErrMsgTxt("getStats: Unexpected arguments.");
+
+        plhs[0] = bdms_instance->getStatsBySessionId(parseSessionMap(prhs[2], "getStats"));
+        return;
+    }
+
+    if (!strcmp("startFetch", cmd))
+    {
+        if (nlhs != 1 || nrhs != 3)
+            mexErrMsgTxt("startFetch: Unexpected arguments.");
+
+        uint64_t ticket = bdms_instance->startFetch(parseSessionMap(prhs[2], "startFetch"));
+        plhs[0] = mxCreateDoubleScalar((double)ticket);
+        return;
+    }
+
+    if (!strcmp("poll", cmd))
+    {
+        if (nlhs != 1 || nrhs != 3)
+            mexErrMsgTxt("poll: Unexpected arguments.");
+
+        plhs[0] = bdms_instance->poll(parseTicket(prhs[2], "poll"));
+        return;
+    }
+
+    if (!strcmp("wait", cmd))
+    {
+        if (nlhs > 1 || nrhs < 3 || nrhs > 4)
+            mexErrMsgTxt("wait: Unexpected arguments.");
+
+        double timeoutSeconds = nrhs == 4 ? mxGetScalar(prhs[3]) : mxGetInf();
+        bool done = bdms_instance->wait(parseTicket(prhs[2], "wait"), timeoutSeconds);
+        plhs[0] = mxCreateLogicalScalar(done);
+        return;
+    }
 
-        const mxArray *sessionIDsAndDataIDs = prhs[2];
-        size_t numSessions = mxGetNumberOfElements(sessionIDsAndDataIDs);
+    if (!strcmp("collect", cmd))
+    {
+        if (nlhs != 1 || nrhs != 3)
+            mexErrMsgTxt("collect: Unexpected arguments.");
+
+        plhs[0] = bdms_instance->collect(parseTicket(prhs[2], "collect"));
+        return;
+    }
+
+    // Hint identifiers that will be asked for soon, see BaseBDMSDataManager::prefetch
+    if (!strcmp("prefetch", cmd))
+    {
+        if (nlhs != 0 || nrhs != 3)
+            mexErrMsgTxt("prefetch: Unexpected arguments.");
+
+        for (const auto &entry : parseSessionMap(prhs[2], "prefetch"))
+            bdms_instance->prefetch(entry.first, entry.second);
+        return;
+    }
 
-        for (size_t i = 0; i < numSessions; i++)
+    // Path of the decoded cache file of one array, and the offset of its values
+    if (!strcmp("getCachedArrayPath", cmd))
+    {
+        if (nlhs < 1 || nlhs > 2 || nrhs != 4)
+            mexErrMsgTxt("getCachedArrayPath: Unexpected arguments.");
+
+        char sessionID[256];
+        char dataID[1024];
+        if (mxGetString(prhs[2], sessionID, sizeof(sessionID)) || mxGetString(prhs[3], dataID, sizeof(dataID)))
+            mexErrMsgTxt("getCachedArrayPath: Expected a session ID and a data ID.");
+
+        size_t dataOffset = 0;
+        std::string path;
+        bool interrupted = false;
+        try
+        {
+            path = bdms_instance->getCachedArrayPath(sessionID, dataID, dataOffset);
+        }
+        catch (const FetchCancelledError &)
         {
-            mxArray *sessionIDAndDataIDs = mxGetCell(sessionIDsAndDataIDs, i);
-
-            size_t numDataIDsIncludingSessionID = mxGetNumberOfElements(sessionIDAndDataIDs);
-            size_t numDataIDs = numDataIDsIncludingSessionID - 1;
-
-            if (numDataIDs < 1)
-                mexErrMsgTxt("getArraysBySessionId: Each session must have at least one data ID.");
-
-            // get session ID
-            mxArray *sessionID = mxGetCell(sessionIDAndDataIDs, 0);
-            char *sessionIDChars = mxArrayToString(sessionID);
-
-            std::string sessionIDStr = std::string(sessionIDChars);
-            mxFree(sessionIDChars);
-
-            // get data IDs
-            char **dataIDs = (char **)mxCalloc(numDataIDs, sizeof(char *));
-            for (size_t j = 0; j < numDataIDs; j++)
-            {
-                mxArray *dataID = mxGetCell(sessionIDAndDataIDs, j + 1);
-                char *dataIDChars = mxArrayToString(dataID);
-                dataIDs[j] = dataIDChars;
-            }
-            std::vector<std::string> ids(dataIDs, dataIDs + numDataIDs);
-            for (int i = 0; i < numDataIDs; i++)
-            {
-                mxFree(dataIDs[i]);
-            }
-            mxFree(dataIDs);
-
-            // add to request map
-            dataToDownload.emplace(sessionIDStr, ids);
+            // reported below, outside of the catch block
+            interrupted = true;
         }
+        if (interrupted)
+            mexErrMsgIdAndTxt("bdms:interrupted", "getCachedArrayPath: Interrupted by the user.");
+        plhs[0] = mxCreateString(path.c_str());
+        if (nlhs > 1)
+            plhs[1] = mxCreateDoubleScalar((double)dataOffset);
+        return;
+    }
+
+    // Values of an identifier that is generated locally, all of them or
+    // count values from the 1-based index first
+    if (!strcmp("expandGenerated", cmd))
+    {
+        if (nlhs != 1 || nrhs < 3 || nrhs > 5)
+            mexErrMsgTxt("expandGenerated: Unexpected arguments.");
+
+        char dataID[1024];
+        if (mxGetString(prhs[2], dataID, sizeof(dataID)))
+            mexErrMsgTxt("expandGenerated: Expected a data ID.");
+
+        // also rejects malformed identifiers, which fromIdentifier cannot parse
+        if (!bdms_instance->isGeneratedLocally(dataID))
+            mexErrMsgIdAndTxt("bdms:invalidInput", "expandGenerated: %s is not generated locally.", dataID);
+
+        size_t total = DataStats::fromIdentifier(dataID).getTotalValueCount();
+        if (nrhs > 3 && !isIntegerScalar(prhs[3], 1, (double)total + 1))
+            mexErrMsgTxt("expandGenerated: first must be an integer between 1 and the number of values + 1.");
+        double first = nrhs > 3 ? mxGetScalar(prhs[3]) : 1;
+        if (nrhs > 4 && !isIntegerScalar(prhs[4], 0, (double)total - (first - 1)))
+            mexErrMsgTxt("expandGenerated: count must be an integer between 0 and the number of values from first on.");
+        double count = nrhs > 4 ? mxGetScalar(prhs[4]) : (double)total - (first - 1);
+
+        plhs[0] = bdms_instance->expandGenerated(dataID, (size_t)first - 1, (size_t)count);
+        return;
+    }
+
+    // Cancel a background fetch started with startFetch
+    if (!strcmp("cancel", cmd))
+    {
+        if (nlhs != 0 || nrhs != 3)
+            mexErrMsgTxt("cancel: Unexpected arguments.");
+
+        bdms_instance->cancel(parseTicket(prhs[2], "cancel"));
+        return;
+    }
+
+    if (!strcmp("configure", cmd))
+    {
+        if (nlhs != 0 || nrhs != 4)
+            mexErrMsgTxt("configure: Unexpected arguments.");
+
+        char option[64];
+        if (mxGetString(prhs[2], option, sizeof(option)) || !mxIsNumeric(prhs[3]))
+            mexErrMsgTxt("configure: Expected an option name and a numeric value.");
+
+        bdms_instance->configure(option, mxGetScalar(prhs[3]));
+        return;
+    }
+
+    if (!strcmp("getStatistics", cmd))
+    {
+        if (nlhs != 1 || nrhs != 2)
+            mexErrMsgTxt("getStatistics: Unexpected arguments.");
+
+        std::map<std::string, double> statistics = bdms_instance->getStatistics();
+        std::vector<const char *> fieldNames;
+        for (const auto &entry : statistics)
+            fieldNames.push_back(entry.first.c_str());
+
+        plhs[0] = mxCreateStructMatrix(1, 1, (int)fieldNames.size(), fieldNames.data());
+        for (const auto &entry : statistics)
+            mxSetField(plhs[0], 0, entry.first.c_str(), mxCreateDoubleScalar(entry.second));
+        return;
+    }
+
+    if (!strcmp("resetSharedCache", cmd))
+    {
+        if (nlhs != 0 || nrhs != 2)
+            mexErrMsgTxt("resetSharedCache: Unexpected arguments.");
 
-        plhs[0] = bdms_instance->getArraysBySessionId(dataToDownload);
+        BDMSDataManager::resetSharedCache();
         return;
     }
 
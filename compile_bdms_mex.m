@@ -39,10 +39,15 @@ else % Unix (Linux and macOS)
 
     if islinux
         library_files{end + 1} = '-ldl';
+        % shm_open for the shared memory cache
+        library_files{end + 1} = '-lrt';
     end
 
 end
 
+% libut provides utIsInterruptPending, used to cancel downloads on Ctrl-C
+library_files{end + 1} = '-lut';
+
 % Define source files
 source_files = {fullfile(script_dir, 'bdms_mex.cpp')};
 